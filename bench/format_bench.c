@@ -0,0 +1,252 @@
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+/*
+ * Formatter and codec throughput on synthetic result sets, no server needed.
+ * Rows are generated into the same batches the fetch stage fills, then formatted and written
+ * through every codec to /dev/null, so the numbers are CPU cost of formatting plus compression.
+ */
+
+#include <mysql.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "../compress.h"
+#include "../format.h"
+
+guint rows = 200000;
+guint statement_size = 1000000;
+guint compress_threads = 1;
+guint passes = 3;
+gchar *only = NULL;
+
+static GOptionEntry entries[] =
+{
+	{ "rows", 'r', 0, G_OPTION_ARG_INT, &rows, "Rows generated per result set, default 200000", NULL },
+	{ "statement-size", 's', 0, G_OPTION_ARG_INT, &statement_size, "Attempted size of INSERT statement in bytes", NULL },
+	{ "compress-threads", 0, 0, G_OPTION_ARG_INT, &compress_threads, "Compression threads, default 1", NULL },
+	{ "passes", 'n', 0, G_OPTION_ARG_INT, &passes, "Runs per combination, the fastest one is reported", NULL },
+	{ "profile", 0, 0, G_OPTION_ARG_STRING, &only, "Only run this result set profile", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+};
+
+/* Fills buf with cell col of a row, returns length or -1 for NULL */
+typedef glong (*cell_generator)(guint32 *seed, guint col, char *buf);
+
+struct profile {
+	const char *name;
+	guint num_fields;
+	enum enum_field_types type;
+	guint flags;
+	cell_generator generate;
+};
+
+static inline guint32 next_random(guint32 *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static glong gen_int(guint32 *seed, guint col, char *buf) {
+	(void) col;
+	return sprintf(buf, "%u", next_random(seed) >> (next_random(seed) & 31));
+}
+
+static glong gen_decimal(guint32 *seed, guint col, char *buf) {
+	(void) col;
+	return sprintf(buf, "%u.%02u", next_random(seed) % 10000000, next_random(seed) % 100);
+}
+
+static glong gen_short_string(guint32 *seed, guint col, char *buf) {
+	glong i, length = 8 + next_random(seed) % 17;
+	(void) col;
+	for (i = 0; i < length; i++)
+		buf[i] = 'a' + next_random(seed) % 26;
+	return length;
+}
+
+/* Mostly clean text, the odd quote or newline keeps the escape path honest */
+static glong gen_long_string(guint32 *seed, guint col, char *buf) {
+	static const char specials[] = "'\"\n\\";
+	glong i, length = 1000 + next_random(seed) % 2000;
+	(void) col;
+	for (i = 0; i < length; i++) {
+		guint32 r = next_random(seed);
+		buf[i] = (r % 100) ? ' ' + r % 95 : specials[(r >> 8) % 4];
+	}
+	return length;
+}
+
+/* Arbitrary bytes, roughly every 40th one needs escaping as text */
+static glong gen_binary(guint32 *seed, guint col, char *buf) {
+	glong i, length = 256 + next_random(seed) % 512;
+	(void) col;
+	for (i = 0; i < length; i++)
+		buf[i] = next_random(seed);
+	return length;
+}
+
+static glong gen_null_heavy(guint32 *seed, guint col, char *buf) {
+	if (col && next_random(seed) % 5)
+		return -1;
+	return gen_int(seed, col, buf);
+}
+
+static struct profile profiles[] = {
+	{ "ints", 8, MYSQL_TYPE_LONGLONG, 0, gen_int },
+	{ "decimals", 4, MYSQL_TYPE_NEWDECIMAL, 0, gen_decimal },
+	{ "short-strings", 6, MYSQL_TYPE_VAR_STRING, 0, gen_short_string },
+	{ "long-strings", 1, MYSQL_TYPE_BLOB, 0, gen_long_string },
+	{ "escape-heavy", 1, MYSQL_TYPE_BLOB, 0, gen_binary },
+	{ "blobs", 1, MYSQL_TYPE_BLOB, BINARY_FLAG, gen_binary },
+	{ "null-heavy", 12, MYSQL_TYPE_LONGLONG, 0, gen_null_heavy },
+};
+
+/* Result set split into statement sized batches, the way the fetch stage hands it on */
+static GPtrArray *generate_batches(struct profile *profile, gsize *data_bytes) {
+	GPtrArray *batches = g_ptr_array_new();
+	char *buf = g_malloc(4096);
+	guint32 seed = 2463534242u;
+	guint r, i;
+
+	struct row_batch *batch = NULL;
+	*data_bytes = 0;
+	for (r = 0; r < rows; r++) {
+		if (!batch) {
+			batch = g_new0(struct row_batch, 1);
+			batch->data = g_string_sized_new(statement_size);
+			batch->lengths = g_array_new(FALSE, FALSE, sizeof(gulong));
+		}
+		for (i = 0; i < profile->num_fields; i++) {
+			glong length = profile->generate(&seed, i, buf);
+			batch_add_cell(batch, length < 0 ? NULL : buf, length < 0 ? 0 : length);
+		}
+		batch->rows++;
+		if (batch->data->len > statement_size || r == rows - 1) {
+			*data_bytes += batch->data->len;
+			g_ptr_array_add(batches, batch);
+			batch = NULL;
+		}
+	}
+	g_free(buf);
+	return batches;
+}
+
+static void free_batches(GPtrArray *batches) {
+	guint i;
+	for (i = 0; i < batches->len; i++) {
+		struct row_batch *batch = g_ptr_array_index(batches, i);
+		g_string_free(batch->data, TRUE);
+		g_array_free(batch->lengths, TRUE);
+		g_free(batch);
+	}
+	g_ptr_array_free(batches, TRUE);
+}
+
+/* Format all batches and write them through codec, returns seconds taken and SQL bytes produced */
+static gdouble run(struct row_format *format, GPtrArray *batches, enum codec codec, gsize *sql_bytes) {
+	GString *statement = g_string_sized_new(statement_size * 2);
+	struct batch_cursor cursor;
+	guint i;
+
+	*sql_bytes = 0;
+	struct output_file *file = output_open("/dev/null", codec);
+	if (!file) {
+		g_critical("Could not open /dev/null for writing");
+		exit(EXIT_FAILURE);
+	}
+
+	GTimer *timer = g_timer_new();
+	for (i = 0; i < batches->len; i++) {
+		struct row_batch *batch = g_ptr_array_index(batches, i);
+		batch_cursor_init(&cursor, batch);
+		while (format_rows(format, batch, &cursor, statement)) {
+			output_write(file, statement->str, statement->len);
+			*sql_bytes += statement->len;
+			g_string_set_size(statement, 0);
+		}
+	}
+	format_finish(statement);
+	output_write(file, statement->str, statement->len);
+	*sql_bytes += statement->len;
+	output_close(file);
+	gdouble elapsed = g_timer_elapsed(timer, NULL);
+
+	g_timer_destroy(timer);
+	g_string_free(statement, TRUE);
+	return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	GError *error = NULL;
+	GOptionContext *context;
+	enum codec codecs[] = { CODEC_NONE, CODEC_GZIP,
+#ifdef WITH_ZSTD
+		CODEC_ZSTD,
+#endif
+#ifdef WITH_LZ4
+		CODEC_LZ4,
+#endif
+	};
+	guint p, c, n, i;
+
+	g_thread_init(NULL);
+
+	context = g_option_context_new("formatter and codec throughput on synthetic rows");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_print("option parsing failed: %s, try --help\n", error->message);
+		exit(EXIT_FAILURE);
+	}
+	g_option_context_free(context);
+
+	if (!rows || !passes) {
+		g_critical("--rows and --passes have to be positive");
+		exit(EXIT_FAILURE);
+	}
+	compress_init(compress_threads);
+
+	printf("%-14s %-6s %12s %10s %10s\n", "profile", "codec", "rows/s", "in MB/s", "SQL MB/s");
+	for (p = 0; p < G_N_ELEMENTS(profiles); p++) {
+		struct profile *profile = &profiles[p];
+		if (only && strcmp(only, profile->name))
+			continue;
+
+		gsize data_bytes, sql_bytes;
+		GPtrArray *batches = generate_batches(profile, &data_bytes);
+
+		/* Formatters are picked from field metadata, same as for a real result set */
+		MYSQL_FIELD field;
+		memset(&field, 0, sizeof(field));
+		field.type = profile->type;
+		field.flags = profile->flags;
+
+		struct row_format format;
+		format.table = "bench";
+		format.num_fields = profile->num_fields;
+		format.statement_size = statement_size;
+		format.formatters = g_new(field_formatter, profile->num_fields);
+		for (i = 0; i < profile->num_fields; i++)
+			format.formatters[i] = get_field_formatter(&field);
+
+		for (c = 0; c < G_N_ELEMENTS(codecs); c++) {
+			gdouble best = 0;
+			for (n = 0; n < passes; n++) {
+				gdouble elapsed = run(&format, batches, codecs[c], &sql_bytes);
+				if (!n || elapsed < best)
+					best = elapsed;
+			}
+			printf("%-14s %-6s %12.0f %10.1f %10.1f\n", profile->name,
+				codecs[c] == CODEC_NONE ? "none" : codec_extension(codecs[c]) + 1,
+				rows / best, data_bytes / best / 1048576, sql_bytes / best / 1048576);
+		}
+
+		g_free(format.formatters);
+		free_batches(batches);
+	}
+
+	compress_end();
+	return 0;
+}
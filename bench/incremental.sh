@@ -0,0 +1,157 @@
+#!/bin/sh
+#
+# Incremental dump check against a throwaway local mysqld.
+#
+# Takes a full dump, applies inserts, updates (key changes included) and deletes, takes an
+# --incremental dump on top and restores both into a second database, which then has to match
+# the source row for row. Finally a statement based change and a compressed transaction have
+# to make the next incremental dump fail without recording new coordinates. Configured through
+# the environment:
+#
+#   MYSQLD           mysqld binary (default: mysqld from PATH)
+#   CHECK_ROWS       rows per table in the full dump (default 10000)
+#   CHECK_DIR        scratch directory (default: a new one under /tmp, removed afterwards)
+#
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+MYSQLD=${MYSQLD:-mysqld}
+CHECK_ROWS=${CHECK_ROWS:-10000}
+
+if [ ! -x ./mydumper ] || [ ! -x ./myloader ]; then
+	echo "Build mydumper and myloader first" >&2
+	exit 1
+fi
+
+if [ -z "$CHECK_DIR" ]; then
+	CHECK_DIR=$(mktemp -d /tmp/mydumper-incremental.XXXXXX)
+	CLEANUP=1
+fi
+SOCKET=$CHECK_DIR/mysqld.sock
+MYSQL="mysql --no-defaults -uroot -S $SOCKET"
+
+stop_server() {
+	if [ -f "$CHECK_DIR/mysqld.pid" ]; then
+		kill "$(cat "$CHECK_DIR/mysqld.pid")" 2>/dev/null || true
+		while [ -f "$CHECK_DIR/mysqld.pid" ]; do sleep 1; done
+	fi
+	if [ -n "$CLEANUP" ]; then
+		rm -rf "$CHECK_DIR"
+	fi
+}
+trap stop_server EXIT INT TERM
+
+# Throwaway server: own datadir, socket only, row based binary log with full images
+echo "Starting mysqld in $CHECK_DIR"
+mkdir -p "$CHECK_DIR/data"
+if ! $MYSQLD --no-defaults --initialize-insecure --user="$(id -un)" --datadir="$CHECK_DIR/data" >"$CHECK_DIR/init.log" 2>&1; then
+	# Servers without --initialize (MariaDB, MySQL before 5.7) bootstrap through mysql_install_db
+	mysql_install_db --no-defaults --user="$(id -un)" --datadir="$CHECK_DIR/data" >"$CHECK_DIR/init.log" 2>&1
+fi
+$MYSQLD --no-defaults --user="$(id -un)" --datadir="$CHECK_DIR/data" --socket="$SOCKET" --skip-networking \
+	--pid-file="$CHECK_DIR/mysqld.pid" --log-error="$CHECK_DIR/mysqld.err" \
+	--log-bin=binlog --server-id=1 --binlog-format=ROW --binlog-row-image=FULL &
+for i in $(seq 60); do
+	$MYSQL -e "SELECT 1" >/dev/null 2>&1 && break
+	sleep 1
+done
+$MYSQL -e "SELECT 1" >/dev/null
+
+# One table per way rows are matched on replay: single column key, composite key, whole row
+TABLES="pk composite nokey"
+echo "Generating $CHECK_ROWS rows per table"
+$MYSQL <<EOF
+CREATE DATABASE inc;
+USE inc;
+CREATE TABLE digits (d INT);
+INSERT INTO digits VALUES (0),(1),(2),(3),(4),(5),(6),(7),(8),(9);
+CREATE VIEW seq AS
+	SELECT a.d + 10*b.d + 100*c.d + 1000*e.d + 10000*f.d + 100000*g.d AS n
+	FROM digits a, digits b, digits c, digits e, digits f, digits g;
+CREATE TABLE pk (id BIGINT NOT NULL PRIMARY KEY, v INT, s VARCHAR(64), b BLOB, d DATETIME(3)) ENGINE=InnoDB;
+CREATE TABLE composite (a INT NOT NULL, b VARCHAR(16) NOT NULL, v DECIMAL(12,2), PRIMARY KEY (a, b)) ENGINE=InnoDB;
+CREATE TABLE nokey (v INT, s VARCHAR(64)) ENGINE=InnoDB;
+INSERT INTO pk SELECT n, n % 1000, MD5(n), UNHEX(SHA1(n)), '2020-01-01' + INTERVAL n SECOND FROM seq WHERE n < $CHECK_ROWS;
+INSERT INTO composite SELECT n % 100, MD5(n), n / 7 FROM seq WHERE n < $CHECK_ROWS;
+INSERT INTO nokey SELECT n % 50, IF(n % 3, MD5(n), NULL) FROM seq WHERE n < $CHECK_ROWS;
+EOF
+
+echo "Full dump"
+./mydumper -S "$SOCKET" -u root -B inc -T pk,composite,nokey -o "$CHECK_DIR/full"
+
+echo "Applying changes"
+$MYSQL inc <<EOF
+INSERT INTO pk SELECT n + $CHECK_ROWS, n, 'new', NULL, NOW(3) FROM seq WHERE n < 1000;
+UPDATE pk SET v = v + 1, s = CONCAT(s, '''\n\\\\') WHERE id % 7 = 0;
+UPDATE pk SET id = id + 10 * $CHECK_ROWS WHERE id % 11 = 0;
+DELETE FROM pk WHERE id % 13 = 0;
+INSERT INTO composite VALUES (1000, 'x', 1.5), (1001, 'y', NULL);
+UPDATE composite SET b = CONCAT(b, '!') WHERE a = 5;
+DELETE FROM composite WHERE a = 6;
+INSERT INTO nokey VALUES (1, 'dup'), (1, 'dup');
+UPDATE nokey SET s = 'changed' WHERE v = 3 LIMIT 10;
+DELETE FROM nokey WHERE v = 4 LIMIT 20;
+EOF
+
+echo "Incremental dump"
+./mydumper -S "$SOCKET" -u root -B inc -T pk,composite,nokey --incremental "$CHECK_DIR/full" -o "$CHECK_DIR/incremental"
+
+echo "Restoring full and incremental dump"
+$MYSQL -e "CREATE DATABASE restored"
+for t in $TABLES; do
+	$MYSQL -e "CREATE TABLE restored.$t LIKE inc.$t"
+done
+./myloader -S "$SOCKET" -u root -B restored -d "$CHECK_DIR/full"
+./myloader -S "$SOCKET" -u root -B restored -d "$CHECK_DIR/incremental"
+
+failed=0
+for t in $TABLES; do
+	order=$($MYSQL -N -e "SELECT GROUP_CONCAT(COLUMN_NAME ORDER BY ORDINAL_POSITION) FROM information_schema.COLUMNS WHERE TABLE_SCHEMA='inc' AND TABLE_NAME='$t'")
+	$MYSQL -N -e "SELECT * FROM inc.$t ORDER BY $order" >"$CHECK_DIR/$t.source"
+	$MYSQL -N -e "SELECT * FROM restored.$t ORDER BY $order" >"$CHECK_DIR/$t.restored"
+	if cmp -s "$CHECK_DIR/$t.source" "$CHECK_DIR/$t.restored"; then
+		echo "$t: $(wc -l <"$CHECK_DIR/$t.source") rows match"
+	else
+		echo "$t: restored rows differ from the source" >&2
+		diff "$CHECK_DIR/$t.source" "$CHECK_DIR/$t.restored" | head -20 >&2
+		failed=1
+	fi
+done
+
+# Statement based changes can't be replayed, the next incremental dump has to refuse them
+echo "Statement based change"
+$MYSQL inc -e "SET SESSION binlog_format = STATEMENT; UPDATE pk SET v = 0 WHERE id = 1"
+if ./mydumper -S "$SOCKET" -u root -B inc -T pk,composite,nokey --incremental "$CHECK_DIR/incremental" -o "$CHECK_DIR/statement" 2>"$CHECK_DIR/statement.log"; then
+	echo "Incremental dump over a statement based change succeeded" >&2
+	failed=1
+elif grep -q "SHOW MASTER STATUS" "$CHECK_DIR/statement/.metadata"; then
+	echo "Failed incremental dump recorded binary log coordinates" >&2
+	failed=1
+else
+	echo "Refused as expected"
+fi
+
+# Compressed transactions (MySQL 8.0.20 and later) can't be read either, and must not be skipped
+if $MYSQL -N -e "SELECT @@binlog_transaction_compression" >/dev/null 2>&1; then
+	echo "Compressed transaction"
+	./mydumper -S "$SOCKET" -u root -B inc -T pk,composite,nokey -o "$CHECK_DIR/base"
+	$MYSQL inc -e "SET SESSION binlog_transaction_compression = ON; UPDATE pk SET v = 1 WHERE id = 2"
+	if ./mydumper -S "$SOCKET" -u root -B inc -T pk,composite,nokey --incremental "$CHECK_DIR/base" -o "$CHECK_DIR/compressed" 2>"$CHECK_DIR/compressed.log"; then
+		echo "Incremental dump over a compressed transaction succeeded" >&2
+		failed=1
+	elif grep -q "SHOW MASTER STATUS" "$CHECK_DIR/compressed/.metadata"; then
+		echo "Failed incremental dump recorded binary log coordinates" >&2
+		failed=1
+	else
+		echo "Refused as expected"
+	fi
+else
+	echo "Compressed transaction: not supported by this server, skipped"
+fi
+
+if [ "$failed" = 0 ]; then
+	echo "Incremental dump check passed"
+fi
+exit $failed
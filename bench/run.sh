@@ -0,0 +1,144 @@
+#!/bin/sh
+#
+# End-to-end mydumper benchmark against a throwaway local mysqld.
+#
+# Generates one table per key shape, then dumps every shape with each combination of
+# thread count, chunk size and compression, recording wall time, rows/s and peak RSS.
+# Results go to a tab separated file named after the checked out version, diff two of them
+# to compare versions. Everything is configured through the environment:
+#
+#   MYSQLD           mysqld binary (default: mysqld from PATH)
+#   BENCH_ROWS       rows per table (default 1000000)
+#   BENCH_SHAPES     key shapes: dense sparse uuid noindex
+#   BENCH_THREADS    values for --threads (default "1 2 4 8")
+#   BENCH_CHUNKS     values for --rows, 0 dumps tables whole (default "0 100000")
+#   BENCH_COMPRESS   none or a codec for --compress-codec (default "none gzip")
+#   BENCH_REPEAT     runs per combination, the fastest is recorded (default 1)
+#   BENCH_DIR        scratch directory (default: a new one under /tmp, removed afterwards)
+#   BENCH_RESULTS    results file (default bench/results-<version>.tsv)
+#
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+MYSQLD=${MYSQLD:-mysqld}
+BENCH_ROWS=${BENCH_ROWS:-1000000}
+BENCH_SHAPES=${BENCH_SHAPES:-"dense sparse uuid noindex"}
+BENCH_THREADS=${BENCH_THREADS:-"1 2 4 8"}
+BENCH_CHUNKS=${BENCH_CHUNKS:-"0 100000"}
+BENCH_COMPRESS=${BENCH_COMPRESS:-"none gzip"}
+BENCH_REPEAT=${BENCH_REPEAT:-1}
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+BENCH_RESULTS=${BENCH_RESULTS:-bench/results-$VERSION.tsv}
+
+TIME=/usr/bin/time
+if ! $TIME -f %M true >/dev/null 2>&1; then
+	echo "GNU time is needed at $TIME to measure peak RSS" >&2
+	exit 1
+fi
+if [ ! -x ./mydumper ]; then
+	echo "Build mydumper first" >&2
+	exit 1
+fi
+
+if [ -z "$BENCH_DIR" ]; then
+	BENCH_DIR=$(mktemp -d /tmp/mydumper-bench.XXXXXX)
+	CLEANUP=1
+fi
+SOCKET=$BENCH_DIR/mysqld.sock
+MYSQL="mysql --no-defaults -uroot -S $SOCKET"
+
+stop_server() {
+	if [ -f "$BENCH_DIR/mysqld.pid" ]; then
+		kill "$(cat "$BENCH_DIR/mysqld.pid")" 2>/dev/null || true
+		while [ -f "$BENCH_DIR/mysqld.pid" ]; do sleep 1; done
+	fi
+	if [ -n "$CLEANUP" ]; then
+		rm -rf "$BENCH_DIR"
+	fi
+}
+trap stop_server EXIT INT TERM
+
+# Throwaway server: own datadir, socket only, binary log on so mydumper records coordinates
+echo "Starting mysqld in $BENCH_DIR"
+mkdir -p "$BENCH_DIR/data"
+if ! $MYSQLD --no-defaults --initialize-insecure --user="$(id -un)" --datadir="$BENCH_DIR/data" >"$BENCH_DIR/init.log" 2>&1; then
+	# Servers without --initialize (MariaDB, MySQL before 5.7) bootstrap through mysql_install_db
+	mysql_install_db --no-defaults --user="$(id -un)" --datadir="$BENCH_DIR/data" >"$BENCH_DIR/init.log" 2>&1
+fi
+$MYSQLD --no-defaults --user="$(id -un)" --datadir="$BENCH_DIR/data" --socket="$SOCKET" --skip-networking \
+	--pid-file="$BENCH_DIR/mysqld.pid" --log-error="$BENCH_DIR/mysqld.err" \
+	--log-bin=binlog --server-id=1 --innodb-buffer-pool-size=1G &
+for i in $(seq 60); do
+	$MYSQL -e "SELECT 1" >/dev/null 2>&1 && break
+	sleep 1
+done
+$MYSQL -e "SELECT 1" >/dev/null
+
+# Number table 0..10^7-1 from a cross join of digits, the shapes pick their keys from it
+echo "Generating $BENCH_ROWS rows per shape"
+$MYSQL <<EOF
+CREATE DATABASE bench;
+USE bench;
+CREATE TABLE digits (d INT);
+INSERT INTO digits VALUES (0),(1),(2),(3),(4),(5),(6),(7),(8),(9);
+CREATE VIEW seq AS
+	SELECT a.d + 10*b.d + 100*c.d + 1000*e.d + 10000*f.d + 100000*g.d + 1000000*h.d AS n
+	FROM digits a, digits b, digits c, digits e, digits f, digits g, digits h;
+EOF
+
+for shape in $BENCH_SHAPES; do
+	case $shape in
+		# 1..N without gaps, arithmetic chunking is exact
+		dense)   key="id BIGINT NOT NULL PRIMARY KEY"; id="n + 1" ;;
+		# Gappy keys with the upper half far away, static stepping gets this wrong
+		sparse)  key="id BIGINT NOT NULL PRIMARY KEY"; id="IF(n < $BENCH_ROWS/2, n*1000 + n%997, 1099511627776 + n*7)" ;;
+		# Non-integer key, chunked by walking the index
+		uuid)    key="id CHAR(36) NOT NULL PRIMARY KEY"; id="UUID()" ;;
+		# Nothing to chunk on, always dumped by a single thread
+		noindex) key="id BIGINT NOT NULL"; id="n" ;;
+		*) echo "Unknown shape $shape" >&2; exit 1 ;;
+	esac
+	$MYSQL bench <<EOF
+CREATE TABLE $shape ($key, v INT, d DECIMAL(12,2), s VARCHAR(64), t VARCHAR(255)) ENGINE=InnoDB;
+INSERT INTO $shape SELECT $id, n % 65536, n / 100, MD5(n), REPEAT(SHA1(n), 5) FROM seq WHERE n < $BENCH_ROWS;
+ANALYZE TABLE $shape;
+EOF
+done
+
+SERVER=$($MYSQL -N -e "SELECT VERSION()")
+{
+	echo "# mydumper $VERSION, server $SERVER, $BENCH_ROWS rows per table, $(nproc) CPUs"
+	printf "shape\tthreads\tchunk_rows\tcompress\twall_s\trows_per_s\tpeak_rss_kb\toutput_bytes\n"
+} >"$BENCH_RESULTS"
+
+for shape in $BENCH_SHAPES; do
+	for threads in $BENCH_THREADS; do
+		for chunk in $BENCH_CHUNKS; do
+			for codec in $BENCH_COMPRESS; do
+				args="-S $SOCKET -u root -B bench -T $shape -t $threads -o $BENCH_DIR/out"
+				[ "$chunk" != 0 ] && args="$args -r $chunk"
+				[ "$codec" != none ] && args="$args --compress-codec $codec"
+
+				best=""
+				for run in $(seq "$BENCH_REPEAT"); do
+					rm -rf "$BENCH_DIR/out"
+					$TIME -f "%e %M" -o "$BENCH_DIR/time" ./mydumper $args
+					set -- $(cat "$BENCH_DIR/time")
+					if [ -z "$best" ] || awk "BEGIN { exit !($1 < $best) }"; then
+						best=$1
+						rss=$2
+					fi
+				done
+				bytes=$(du -sb "$BENCH_DIR/out" | cut -f1)
+				rate=$(awk "BEGIN { printf \"%.0f\", $BENCH_ROWS / ($best > 0 ? $best : 0.01) }")
+
+				printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$shape" "$threads" "$chunk" "$codec" \
+					"$best" "$rate" "$rss" "$bytes" | tee -a "$BENCH_RESULTS"
+			done
+		done
+	done
+done
+
+echo "Results written to $BENCH_RESULTS"
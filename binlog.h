@@ -0,0 +1,19 @@
+#ifndef _binlog_h
+#define _binlog_h
+
+#include <mysql.h>
+#include <glib.h>
+#include "compress.h"
+
+/* Decides whether changes of database.table end up in the incremental dump, table is NULL to ask about any table of database */
+typedef gboolean (*binlog_filter)(char *database, char *table);
+
+/*
+ * Replay row events between two binlog coordinates into per-table delta files in directory.
+ * stream is a dedicated connection used for the replication protocol, conn is used for table definitions.
+ * Returns number of tables written, -1 on error
+ */
+int binlog_dump(MYSQL *conn, MYSQL *stream, const char *start_file, guint64 start_pos,
+	const char *stop_file, guint64 stop_pos, binlog_filter filter, const char *directory, enum codec codec);
+
+#endif
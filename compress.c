@@ -0,0 +1,870 @@
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef WITH_IO_URING
+#include <liburing.h>
+#endif
+#include "compress.h"
+
+/* Size of reads when decompressing input */
+#define INPUT_CHUNK_SIZE 65536
+
+/* O_DIRECT writes go out in aligned buffers of this size, two per file so one fills while the other is written */
+#define DIRECT_BUFFER_SIZE (1024*1024)
+#define DIRECT_ALIGNMENT 4096
+
+/* Block waiting for (or done with) compression on the shared pool */
+struct compress_block {
+	struct output_file *file;
+	GString *in;
+	char *out;
+	gsize out_len;
+	gsize out_size;
+	gboolean done;
+	gboolean failed;
+};
+
+struct output_file {
+	enum codec codec;
+	int fd;
+	/* Protects done flags of pending blocks */
+	GMutex *mutex;
+	GCond *cond;
+	/* Submitted blocks in stream order, written out as soon as head is done */
+	GQueue *pending;
+	GQueue *free;
+	struct compress_block *current;
+	int error;
+	/* O_DIRECT double buffering, buffer[current] is being filled, the other one may be in flight */
+	gboolean direct;
+	char *buffer[2];
+	gsize fill;
+	int current_buffer;
+	gboolean inflight[2];
+	gsize inflight_len[2];
+	off_t inflight_offset[2];
+	off_t offset;
+#ifdef WITH_IO_URING
+	struct io_uring ring;
+#endif
+	/* Frame id within the --stream output */
+	guint32 stream_id;
+};
+
+struct input_file {
+	enum codec codec;
+	int fd;
+	/* Pieces handed over by another thread instead of a file, see input_open_chunks() */
+	GAsyncQueue *chunks;
+	GAsyncQueue *returned;
+	GString *chunk;
+	gboolean claimed;
+	gboolean eof;
+	GString *buffer;
+	gsize pos;
+	char *raw;
+	char *raw_buffer;
+	gsize raw_len;
+	gsize raw_pos;
+	/* Decompressor is inside a frame (or gzip member), it may hold output beyond the end of raw input */
+	gboolean frame_open;
+	int error;
+	/* Every compressed block is a gzip member of its own, stream is reset after each */
+	z_stream gz;
+	gboolean gz_init;
+#ifdef WITH_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+#ifdef WITH_LZ4
+	LZ4F_dctx *lz4;
+#endif
+};
+
+static GThreadPool *pool = NULL;
+static guint max_pending = 2;
+static gboolean direct_io = FALSE;
+static gboolean sync_output = FALSE;
+
+/* --stream: all output files are multiplexed as frames onto a single descriptor */
+static int stream_fd = -1;
+static GMutex *stream_mutex = NULL;
+static gint stream_next_id = 0;
+
+static void compress_block(struct compress_block *block, gpointer user_data);
+
+enum codec codec_from_name(const char *name) {
+	if (!name || !g_ascii_strcasecmp(name, "gzip") || !g_ascii_strcasecmp(name, "gz"))
+		return CODEC_GZIP;
+#ifdef WITH_ZSTD
+	if (!g_ascii_strcasecmp(name, "zstd"))
+		return CODEC_ZSTD;
+#endif
+#ifdef WITH_LZ4
+	if (!g_ascii_strcasecmp(name, "lz4"))
+		return CODEC_LZ4;
+#endif
+	g_critical("Unsupported compression codec: %s", name);
+	exit(EXIT_FAILURE);
+}
+
+enum codec codec_from_filename(const char *filename) {
+	if (g_str_has_suffix(filename, ".gz"))
+		return CODEC_GZIP;
+	if (g_str_has_suffix(filename, ".zst"))
+		return CODEC_ZSTD;
+	if (g_str_has_suffix(filename, ".lz4"))
+		return CODEC_LZ4;
+	return CODEC_NONE;
+}
+
+const char *codec_extension(enum codec codec) {
+	switch (codec) {
+		case CODEC_GZIP:
+			return ".gz";
+		case CODEC_ZSTD:
+			return ".zst";
+		case CODEC_LZ4:
+			return ".lz4";
+		default:
+			return "";
+	}
+}
+
+/* Shared compression pool, blocks of all open files are compressed on it */
+void compress_init(guint threads) {
+	if (!threads)
+		threads = 1;
+	max_pending = threads * 2;
+	pool = g_thread_pool_new((GFunc)compress_block, NULL, threads, FALSE, NULL);
+}
+
+void compress_end(void) {
+	if (pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+	pool = NULL;
+}
+
+/* Write output with O_DIRECT (through io_uring where available), bypassing the page cache */
+void output_set_direct_io(gboolean enable) {
+	direct_io = enable;
+}
+
+/* Make output_close() return only once data is on stable storage */
+void output_set_sync(gboolean enable) {
+	sync_output = enable;
+}
+
+/* Write every output file as frames of one stream on fd instead of files, see stream_read_frame() */
+void output_set_stream(int fd) {
+	stream_fd = fd;
+	stream_mutex = g_mutex_new();
+}
+
+static int write_all(int fd, const char *data, gsize len) {
+	while (len) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static int pwrite_all(int fd, const char *data, gsize len, off_t offset) {
+	while (len) {
+		ssize_t written = pwrite(fd, data, len, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/*
+ * Wait until the write of buffer n is on disk so it can be reused.
+ * Completions come in any order, the one of the other buffer is settled on the way
+ */
+static int direct_wait(struct output_file *file, int n) {
+#ifdef WITH_IO_URING
+	while (file->inflight[n]) {
+		struct io_uring_cqe *cqe;
+		if (io_uring_wait_cqe(&file->ring, &cqe) < 0)
+			return -1;
+		int m = GPOINTER_TO_INT(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+		io_uring_cqe_seen(&file->ring, cqe);
+		file->inflight[m] = FALSE;
+		if (res < 0) {
+			errno = -res;
+			return -1;
+		}
+		/* Short writes are rare, finish them synchronously */
+		if ((gsize)res < file->inflight_len[m] && pwrite_all(file->fd, file->buffer[m] + res,
+				file->inflight_len[m] - res, file->inflight_offset[m] + res))
+			return -1;
+	}
+#endif
+	return 0;
+}
+
+/* Hand a full aligned buffer to the kernel, without io_uring this is a plain synchronous O_DIRECT write */
+static int direct_submit(struct output_file *file, int n, gsize len) {
+	off_t offset = file->offset;
+	file->offset += len;
+#ifdef WITH_IO_URING
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&file->ring);
+	if (sqe) {
+		io_uring_prep_write(sqe, file->fd, file->buffer[n], len, offset);
+		io_uring_sqe_set_data(sqe, GINT_TO_POINTER(n));
+		file->inflight[n] = TRUE;
+		file->inflight_len[n] = len;
+		file->inflight_offset[n] = offset;
+		return io_uring_submit(&file->ring) < 0 ? -1 : 0;
+	}
+#endif
+	return pwrite_all(file->fd, file->buffer[n], len, offset);
+}
+
+static int direct_write(struct output_file *file, const char *data, gsize len) {
+	while (len) {
+		gsize chunk = MIN(len, DIRECT_BUFFER_SIZE - file->fill);
+		memcpy(file->buffer[file->current_buffer] + file->fill, data, chunk);
+		file->fill += chunk;
+		data += chunk;
+		len -= chunk;
+		if (file->fill == DIRECT_BUFFER_SIZE) {
+			if (direct_submit(file, file->current_buffer, DIRECT_BUFFER_SIZE))
+				return -1;
+			file->current_buffer ^= 1;
+			file->fill = 0;
+			if (direct_wait(file, file->current_buffer))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Drain in-flight writes, the unaligned tail is written with O_DIRECT switched off */
+static int direct_finish(struct output_file *file) {
+	int error = 0;
+
+	/* After a failed write the other buffer may still be in flight too */
+	if (direct_wait(file, 0))
+		error = -1;
+	if (direct_wait(file, 1))
+		error = -1;
+	if (file->fill) {
+		fcntl(file->fd, F_SETFL, fcntl(file->fd, F_GETFL) & ~O_DIRECT);
+		if (pwrite_all(file->fd, file->buffer[file->current_buffer], file->fill, file->offset))
+			error = -1;
+	}
+#ifdef WITH_IO_URING
+	io_uring_queue_exit(&file->ring);
+#endif
+	free(file->buffer[0]);
+	free(file->buffer[1]);
+	return error;
+}
+
+/* Frames of concurrent writers never interleave, the header and payload go out under one lock */
+static int stream_frame(enum stream_frame type, guint32 id, const char *data, gsize len) {
+	guchar header[STREAM_HEADER_LEN];
+	int error;
+
+	memcpy(header, STREAM_MAGIC, 4);
+	header[4] = type;
+	header[5] = id;
+	header[6] = id >> 8;
+	header[7] = id >> 16;
+	header[8] = id >> 24;
+	header[9] = len;
+	header[10] = len >> 8;
+	header[11] = len >> 16;
+	header[12] = len >> 24;
+
+	g_mutex_lock(stream_mutex);
+	error = write_all(stream_fd, (const char *)header, STREAM_HEADER_LEN) || (len && write_all(stream_fd, data, len));
+	g_mutex_unlock(stream_mutex);
+	return error ? -1 : 0;
+}
+
+static int read_all(int fd, char *data, gsize len) {
+	gsize got = 0;
+
+	while (got < len) {
+		ssize_t n = read(fd, data + got, len - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+/* Next frame of a --stream archive, returns 1 on success, 0 at the end of the stream and -1 if it is corrupt or truncated */
+int stream_read_frame(int fd, enum stream_frame *type, guint32 *id, GString *payload) {
+	guchar header[STREAM_HEADER_LEN];
+	int n = read_all(fd, (char *)header, STREAM_HEADER_LEN);
+
+	if (!n)
+		return 0;
+	if (n < STREAM_HEADER_LEN || memcmp(header, STREAM_MAGIC, 4))
+		return -1;
+
+	*type = header[4];
+	*id = header[5] | (header[6] << 8) | (header[7] << 16) | ((guint32)header[8] << 24);
+	guint32 len = header[9] | (header[10] << 8) | (header[11] << 16) | ((guint32)header[12] << 24);
+
+	g_string_set_size(payload, len);
+	if (read_all(fd, payload->str, len) < (int)len)
+		return -1;
+	return 1;
+}
+
+static int sink_write(struct output_file *file, const char *data, gsize len) {
+	if (stream_fd >= 0)
+		return stream_frame(STREAM_DATA, file->stream_id, data, len);
+	if (file->direct)
+		return direct_write(file, data, len);
+	return write_all(file->fd, data, len);
+}
+
+static void compress_block(struct compress_block *block, gpointer user_data) {
+	(void) user_data;
+	struct output_file *file = block->file;
+	gboolean failed = FALSE;
+
+	switch (file->codec) {
+		case CODEC_GZIP: {
+			z_stream z;
+			memset(&z, 0, sizeof(z));
+			/* windowBits+16 gives a complete gzip member, concatenated members are a valid gzip stream */
+			if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				failed = TRUE;
+				break;
+			}
+			gsize bound = deflateBound(&z, block->in->len);
+			if (block->out_size < bound) {
+				block->out = g_realloc(block->out, bound);
+				block->out_size = bound;
+			}
+			z.next_in = (Bytef *)block->in->str;
+			z.avail_in = block->in->len;
+			z.next_out = (Bytef *)block->out;
+			z.avail_out = block->out_size;
+			if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+				failed = TRUE;
+			block->out_len = z.total_out;
+			deflateEnd(&z);
+			break;
+		}
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD: {
+			gsize bound = ZSTD_compressBound(block->in->len);
+			if (block->out_size < bound) {
+				block->out = g_realloc(block->out, bound);
+				block->out_size = bound;
+			}
+			gsize ret = ZSTD_compress(block->out, block->out_size, block->in->str, block->in->len, 3);
+			if (ZSTD_isError(ret))
+				failed = TRUE;
+			else
+				block->out_len = ret;
+			break;
+		}
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4: {
+			gsize bound = LZ4F_compressFrameBound(block->in->len, NULL);
+			if (block->out_size < bound) {
+				block->out = g_realloc(block->out, bound);
+				block->out_size = bound;
+			}
+			gsize ret = LZ4F_compressFrame(block->out, block->out_size, block->in->str, block->in->len, NULL);
+			if (LZ4F_isError(ret))
+				failed = TRUE;
+			else
+				block->out_len = ret;
+			break;
+		}
+#endif
+		default:
+			failed = TRUE;
+	}
+
+	g_mutex_lock(file->mutex);
+	block->failed = failed;
+	block->done = TRUE;
+	g_cond_broadcast(file->cond);
+	g_mutex_unlock(file->mutex);
+}
+
+/* Write out finished blocks in stream order, optionally waiting for all of them */
+static void flush_blocks(struct output_file *file, gboolean wait_all, guint keep) {
+	g_mutex_lock(file->mutex);
+	for (;;) {
+		struct compress_block *block = g_queue_peek_head(file->pending);
+		if (!block || (!wait_all && g_queue_get_length(file->pending) <= keep && !block->done))
+			break;
+		if (!block->done) {
+			g_cond_wait(file->cond, file->mutex);
+			continue;
+		}
+		g_queue_pop_head(file->pending);
+		g_mutex_unlock(file->mutex);
+
+		if (block->failed) {
+			g_critical("Compression of output block failed");
+			file->error = 1;
+		} else if (!file->error && sink_write(file, block->out, block->out_len)) {
+			g_critical("Error writing compressed data: %s", g_strerror(errno));
+			file->error = 1;
+		}
+		g_string_set_size(block->in, 0);
+		block->done = FALSE;
+		block->failed = FALSE;
+
+		g_mutex_lock(file->mutex);
+		g_queue_push_tail(file->free, block);
+	}
+	g_mutex_unlock(file->mutex);
+}
+
+static void submit_block(struct output_file *file) {
+	struct compress_block *block = file->current;
+	file->current = NULL;
+
+	g_mutex_lock(file->mutex);
+	g_queue_push_tail(file->pending, block);
+	g_mutex_unlock(file->mutex);
+	g_thread_pool_push(pool, block, NULL);
+
+	/* Bound memory per file, wait for oldest block once too many are in flight */
+	flush_blocks(file, FALSE, max_pending);
+}
+
+static struct compress_block *get_block(struct output_file *file) {
+	g_mutex_lock(file->mutex);
+	struct compress_block *block = g_queue_pop_head(file->free);
+	g_mutex_unlock(file->mutex);
+
+	if (!block) {
+		block = g_new0(struct compress_block, 1);
+		block->file = file;
+		block->in = g_string_sized_new(COMPRESS_BLOCK_SIZE);
+	}
+	return block;
+}
+
+static struct output_file *output_new(enum codec codec, int fd) {
+	struct output_file *file = g_new0(struct output_file, 1);
+	file->codec = codec;
+	file->fd = fd;
+	if (codec != CODEC_NONE) {
+		g_assert(pool != NULL);
+		file->mutex = g_mutex_new();
+		file->cond = g_cond_new();
+		file->pending = g_queue_new();
+		file->free = g_queue_new();
+	}
+	return file;
+}
+
+struct output_file *output_open(const char *filename, enum codec codec) {
+	gboolean direct = direct_io && stream_fd < 0;
+	int fd = -1;
+
+	if (stream_fd >= 0) {
+		/* Files are named by their name inside the export directory */
+		gchar *name = g_path_get_basename(filename);
+		guint32 id = g_atomic_int_exchange_and_add(&stream_next_id, 1);
+		int error = stream_frame(STREAM_OPEN, id, name, strlen(name));
+		g_free(name);
+		if (error)
+			return NULL;
+
+		struct output_file *file = output_new(codec, -1);
+		file->stream_id = id;
+		return file;
+	}
+
+	if (direct) {
+		fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0660);
+		/* Some filesystems (tmpfs) refuse O_DIRECT, buffered writes still work there */
+		if (fd < 0 && errno == EINVAL)
+			direct = FALSE;
+	}
+	if (!direct)
+		fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0660);
+	if (fd < 0)
+		return NULL;
+
+	struct output_file *file = output_new(codec, fd);
+	if (direct) {
+		if (posix_memalign((void **)&file->buffer[0], DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE)
+			|| posix_memalign((void **)&file->buffer[1], DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE)) {
+			g_critical("Could not allocate aligned buffers for %s", filename);
+			exit(EXIT_FAILURE);
+		}
+#ifdef WITH_IO_URING
+		if (io_uring_queue_init(2, &file->ring, 0) < 0) {
+			g_critical("Could not set up io_uring for %s", filename);
+			exit(EXIT_FAILURE);
+		}
+#endif
+		file->direct = TRUE;
+	}
+	return file;
+}
+
+gssize output_write(struct output_file *file, const char *data, gsize len) {
+	gsize left = len;
+
+	if (file->codec == CODEC_NONE) {
+		/* Sticks like a failed compressed block, output_close() has to report it */
+		if (file->error || sink_write(file, data, len)) {
+			file->error = 1;
+			return -1;
+		}
+		return len;
+	}
+
+	while (left) {
+		if (!file->current)
+			file->current = get_block(file);
+		GString *in = file->current->in;
+		gsize chunk = MIN(left, COMPRESS_BLOCK_SIZE - in->len);
+		g_string_append_len(in, data, chunk);
+		data += chunk;
+		left -= chunk;
+		if (in->len >= COMPRESS_BLOCK_SIZE)
+			submit_block(file);
+	}
+	return file->error ? -1 : (gssize)len;
+}
+
+int output_close(struct output_file *file) {
+	int error;
+
+	if (file->codec != CODEC_NONE) {
+		if (file->current && file->current->in->len)
+			submit_block(file);
+		flush_blocks(file, TRUE, 0);
+
+		struct compress_block *block;
+		if (file->current)
+			g_queue_push_tail(file->free, file->current);
+		while ((block = g_queue_pop_head(file->free))) {
+			g_string_free(block->in, TRUE);
+			g_free(block->out);
+			g_free(block);
+		}
+		g_queue_free(file->free);
+		g_queue_free(file->pending);
+		g_cond_free(file->cond);
+		g_mutex_free(file->mutex);
+	}
+
+	if (stream_fd >= 0) {
+		if (stream_frame(STREAM_CLOSE, file->stream_id, NULL, 0))
+			file->error = 1;
+	} else {
+		if (file->direct && direct_finish(file))
+			file->error = 1;
+		if (sync_output && fdatasync(file->fd))
+			file->error = 1;
+		if (close(file->fd))
+			file->error = 1;
+	}
+	error = file->error;
+	g_free(file);
+	return error;
+}
+
+static struct input_file *input_new(const char *filename) {
+	struct input_file *file = g_new0(struct input_file, 1);
+	file->codec = codec_from_filename(filename);
+	file->fd = -1;
+
+	switch (file->codec) {
+		case CODEC_NONE:
+			break;
+		case CODEC_GZIP:
+			/* 15+32 accepts gzip and zlib headers */
+			if (inflateInit2(&file->gz, 15+32) != Z_OK)
+				goto fail;
+			file->gz_init = TRUE;
+			break;
+#ifdef WITH_ZSTD
+		case CODEC_ZSTD:
+			file->zstd = ZSTD_createDStream();
+			ZSTD_initDStream(file->zstd);
+			break;
+#endif
+#ifdef WITH_LZ4
+		case CODEC_LZ4:
+			if (LZ4F_isError(LZ4F_createDecompressionContext(&file->lz4, LZ4F_VERSION)))
+				goto fail;
+			break;
+#endif
+		default:
+			g_critical("Unsupported compression for %s", filename);
+			goto fail;
+	}
+	file->buffer = g_string_sized_new(INPUT_CHUNK_SIZE);
+	return file;
+
+fail:
+	input_close(file);
+	return NULL;
+}
+
+struct input_file *input_open(const char *filename) {
+	struct input_file *file = input_new(filename);
+
+	if (!file)
+		return NULL;
+	file->fd = open(filename, O_RDONLY);
+	if (file->fd < 0) {
+		input_close(file);
+		return NULL;
+	}
+	file->raw_buffer = g_malloc(INPUT_CHUNK_SIZE);
+	return file;
+}
+
+/*
+ * Input fed by another thread: GStrings are popped from chunks, an empty one ends the input.
+ * The reader reports on returned: STREAM_CLAIMED once it starts, STREAM_CONSUMED for every piece
+ * it is done with and STREAM_CLOSED when it closes the input. Codec is picked by name
+ */
+struct input_file *input_open_chunks(const char *name, GAsyncQueue *chunks, GAsyncQueue *returned) {
+	struct input_file *file = input_new(name);
+
+	if (!file)
+		return NULL;
+	g_async_queue_ref(chunks);
+	g_async_queue_ref(returned);
+	file->chunks = chunks;
+	file->returned = returned;
+	return file;
+}
+
+/* Next piece of raw (still compressed) input, FALSE at the end */
+static gboolean input_read_raw(struct input_file *file) {
+	if (file->chunks) {
+		if (!file->claimed) {
+			file->claimed = TRUE;
+			g_async_queue_push(file->returned, GINT_TO_POINTER(STREAM_CLAIMED));
+		}
+		if (file->chunk) {
+			g_string_free(file->chunk, TRUE);
+			file->chunk = NULL;
+			g_async_queue_push(file->returned, GINT_TO_POINTER(STREAM_CONSUMED));
+		}
+		if (file->eof)
+			return FALSE;
+
+		GString *chunk = (GString *)g_async_queue_pop(file->chunks);
+		if (!chunk->len) {
+			g_string_free(chunk, TRUE);
+			file->eof = TRUE;
+			return FALSE;
+		}
+		file->chunk = chunk;
+		file->raw = chunk->str;
+		file->raw_len = chunk->len;
+		file->raw_pos = 0;
+		return TRUE;
+	}
+
+	ssize_t n = read(file->fd, file->raw_buffer, INPUT_CHUNK_SIZE);
+	if (n < 0) {
+		g_critical("Error reading input: %s", strerror(errno));
+		file->error = -1;
+	}
+	if (n <= 0)
+		return FALSE;
+	file->raw = file->raw_buffer;
+	file->raw_len = n;
+	file->raw_pos = 0;
+	return TRUE;
+}
+
+/*
+ * Refill decompressed buffer, FALSE once input is exhausted or broken.
+ * At the end of raw input the decompressor is run dry first, a frame still open after that is truncated input
+ */
+static gboolean input_fill(struct input_file *file) {
+	GString *buffer = file->buffer;
+	file->pos = 0;
+
+	for (;;) {
+		gboolean draining = FALSE;
+		if (file->raw_pos == file->raw_len && !input_read_raw(file)) {
+			if (file->error || !file->frame_open) {
+				g_string_set_size(buffer, 0);
+				return FALSE;
+			}
+			draining = TRUE;
+			file->raw = NULL;
+			file->raw_len = file->raw_pos = 0;
+		}
+		g_string_set_size(buffer, INPUT_CHUNK_SIZE);
+		gsize produced = 0;
+		switch (file->codec) {
+			case CODEC_NONE:
+				produced = MIN(INPUT_CHUNK_SIZE, file->raw_len - file->raw_pos);
+				memcpy(buffer->str, file->raw + file->raw_pos, produced);
+				file->raw_pos += produced;
+				break;
+			case CODEC_GZIP: {
+				file->gz.next_in = (Bytef *)file->raw + file->raw_pos;
+				file->gz.avail_in = file->raw_len - file->raw_pos;
+				file->gz.next_out = (Bytef *)buffer->str;
+				file->gz.avail_out = INPUT_CHUNK_SIZE;
+				int ret = inflate(&file->gz, Z_NO_FLUSH);
+				if (ret == Z_STREAM_END) {
+					inflateReset(&file->gz);
+				} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+					g_critical("Corrupt gzip input");
+					file->error = -1;
+					g_string_set_size(buffer, 0);
+					return FALSE;
+				}
+				file->raw_pos = file->raw_len - file->gz.avail_in;
+				produced = INPUT_CHUNK_SIZE - file->gz.avail_out;
+				/* inflateReset() clears total_in, anything read since belongs to an unfinished member */
+				file->frame_open = file->gz.total_in != 0;
+				break;
+			}
+#ifdef WITH_ZSTD
+			case CODEC_ZSTD: {
+				ZSTD_inBuffer in = { file->raw, file->raw_len, file->raw_pos };
+				ZSTD_outBuffer out = { buffer->str, INPUT_CHUNK_SIZE, 0 };
+				size_t ret = ZSTD_decompressStream(file->zstd, &out, &in);
+				if (ZSTD_isError(ret)) {
+					g_critical("Corrupt zstd input");
+					file->error = -1;
+					g_string_set_size(buffer, 0);
+					return FALSE;
+				}
+				/* 0 only once a frame is completely decoded and flushed */
+				file->frame_open = ret != 0;
+				file->raw_pos = in.pos;
+				produced = out.pos;
+				break;
+			}
+#endif
+#ifdef WITH_LZ4
+			case CODEC_LZ4: {
+				gsize dst_size = INPUT_CHUNK_SIZE;
+				gsize src_size = file->raw_len - file->raw_pos;
+				size_t hint = LZ4F_decompress(file->lz4, buffer->str, &dst_size, file->raw + file->raw_pos, &src_size, NULL);
+				if (LZ4F_isError(hint)) {
+					g_critical("Corrupt lz4 input");
+					file->error = -1;
+					g_string_set_size(buffer, 0);
+					return FALSE;
+				}
+				/* Size hint drops to 0 once a frame is complete */
+				file->frame_open = hint != 0;
+				file->raw_pos += src_size;
+				produced = dst_size;
+				break;
+			}
+#endif
+			default:
+				break;
+		}
+		g_string_set_size(buffer, produced);
+		if (produced)
+			return TRUE;
+		if (draining && file->frame_open) {
+			g_critical("Truncated %s input", codec_extension(file->codec) + 1);
+			file->error = -1;
+			return FALSE;
+		}
+	}
+}
+
+/* Non-zero if input ended on a read error, corrupt or truncated data rather than a clean end */
+int input_error(struct input_file *file) {
+	return file->error;
+}
+
+/* Append next line (including newline) to line, FALSE when there is nothing left */
+gboolean input_readline(struct input_file *file, GString *line) {
+	gboolean got = FALSE;
+
+	for (;;) {
+		GString *buffer = file->buffer;
+		if (file->pos < buffer->len) {
+			char *start = buffer->str + file->pos;
+			char *nl = memchr(start, '\n', buffer->len - file->pos);
+			gsize n = nl ? (gsize)(nl - start + 1) : buffer->len - file->pos;
+			g_string_append_len(line, start, n);
+			file->pos += n;
+			got = TRUE;
+			if (nl)
+				return TRUE;
+		}
+		if (!input_fill(file))
+			return got;
+	}
+}
+
+void input_close(struct input_file *file) {
+	if (file->gz_init)
+		inflateEnd(&file->gz);
+	if (file->fd >= 0)
+		close(file->fd);
+	if (file->chunks) {
+		/* Whatever the feeding thread still has queued is ours to free */
+		GString *chunk;
+		if (file->chunk)
+			g_string_free(file->chunk, TRUE);
+		g_async_queue_push(file->returned, GINT_TO_POINTER(STREAM_CLOSED));
+		while ((chunk = g_async_queue_try_pop(file->chunks)))
+			g_string_free(chunk, TRUE);
+		g_async_queue_unref(file->chunks);
+		g_async_queue_unref(file->returned);
+	}
+#ifdef WITH_ZSTD
+	if (file->zstd)
+		ZSTD_freeDStream(file->zstd);
+#endif
+#ifdef WITH_LZ4
+	if (file->lz4)
+		LZ4F_freeDecompressionContext(file->lz4);
+#endif
+	if (file->buffer)
+		g_string_free(file->buffer, TRUE);
+	g_free(file->raw_buffer);
+	g_free(file);
+}
@@ -0,0 +1,44 @@
+#ifndef _compress_h
+#define _compress_h
+
+#include <glib.h>
+
+enum codec { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4 };
+
+/* Size of independently compressed blocks, every block becomes a self-contained gzip member or zstd/lz4 frame */
+#define COMPRESS_BLOCK_SIZE (1024*1024)
+
+/* Frames of a --stream archive: "MYDF", frame type, then file id and payload length as 32 bit little-endian */
+#define STREAM_MAGIC "MYDF"
+#define STREAM_HEADER_LEN 13
+
+enum stream_frame { STREAM_OPEN = 1, STREAM_DATA, STREAM_CLOSE };
+
+/* What readers of input_open_chunks() report back to the feeding thread */
+enum stream_event { STREAM_CLAIMED = 1, STREAM_CONSUMED, STREAM_CLOSED };
+
+struct output_file;
+struct input_file;
+
+enum codec codec_from_name(const char *name);
+enum codec codec_from_filename(const char *filename);
+const char *codec_extension(enum codec codec);
+
+void compress_init(guint threads);
+void compress_end(void);
+
+void output_set_direct_io(gboolean enable);
+void output_set_sync(gboolean enable);
+void output_set_stream(int fd);
+struct output_file *output_open(const char *filename, enum codec codec);
+gssize output_write(struct output_file *file, const char *data, gsize len);
+int output_close(struct output_file *file);
+
+struct input_file *input_open(const char *filename);
+struct input_file *input_open_chunks(const char *name, GAsyncQueue *chunks, GAsyncQueue *returned);
+int stream_read_frame(int fd, enum stream_frame *type, guint32 *id, GString *payload);
+gboolean input_readline(struct input_file *file, GString *line);
+int input_error(struct input_file *file);
+void input_close(struct input_file *file);
+
+#endif
@@ -0,0 +1,289 @@
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <mysql.h>
+#include <string.h>
+#include <glib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "format.h"
+
+/*
+ * Column formatters, picked once per result set from field metadata.
+ * Each one appends a single cell straight into the statement buffer and returns the exact number of bytes written.
+ */
+
+/* Make room for up to len more bytes, returns where to write them */
+static inline char *statement_reserve(GString *statement, gsize len) {
+	gsize old_len = statement->len;
+	g_string_set_size(statement, old_len + len);
+	return statement->str + old_len;
+}
+
+/* Give back reserved space that was not used */
+static inline void statement_commit(GString *statement, char *end) {
+	statement->len = end - statement->str;
+	statement->str[statement->len] = 0;
+}
+
+/* Numbers come over the wire in SQL literal form already */
+gsize format_numeric(GString *statement, const char *data, gulong length) {
+	memcpy(statement_reserve(statement, length), data, length);
+	return length;
+}
+
+static inline char *hex_digits(char *p, const char *data, gulong length) {
+	static const char hex[] = "0123456789ABCDEF";
+	gulong i;
+
+	for (i = 0; i < length; i++) {
+		*p++ = hex[(guchar)data[i] >> 4];
+		*p++ = hex[(guchar)data[i] & 0xf];
+	}
+	return p;
+}
+
+/* Binary data as 0x... literal, nothing to escape and no charset conversion on restore */
+gsize format_hex(GString *statement, const char *data, gulong length) {
+	if (!length) {
+		g_string_append_len(statement, "\"\"", 2);
+		return 2;
+	}
+
+	char *p = statement_reserve(statement, length*2+2);
+	*p++ = '0';
+	*p++ = 'x';
+	hex_digits(p, data, length);
+	return length*2+2;
+}
+
+/* Same escapes as mysql_real_escape_string(), 0 means no escape needed */
+static const char escape_table[256] = {
+	['\0'] = '0', ['\n'] = 'n', ['\r'] = 'r', ['\\'] = '\\', ['\''] = '\'', ['"'] = '"', ['\032'] = 'Z'
+};
+
+/* Escape data to p, scanning 16 bytes at a time for characters that need escaping. Returns the new end */
+static inline char *escape_string(char *p, const char *data, gulong length) {
+	const char *end = data + length;
+
+#ifdef __SSE2__
+	const __m128i nul = _mm_set1_epi8('\0'), nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'),
+		bs = _mm_set1_epi8('\\'), sq = _mm_set1_epi8('\''), dq = _mm_set1_epi8('"'), sub = _mm_set1_epi8('\032');
+
+	while (end - data >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)data);
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, nul), _mm_cmpeq_epi8(chunk, nl)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, bs))),
+			_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, sq), _mm_cmpeq_epi8(chunk, dq)),
+				_mm_cmpeq_epi8(chunk, sub)));
+		int mask = _mm_movemask_epi8(hits);
+
+		if (!mask) {
+			_mm_storeu_si128((__m128i *)p, chunk);
+			p += 16;
+			data += 16;
+			continue;
+		}
+		/* Copy clean prefix, escape the first hit and rescan from there */
+		int clean = __builtin_ctz(mask);
+		memcpy(p, data, clean);
+		p += clean;
+		data += clean;
+		*p++ = '\\';
+		*p++ = escape_table[(guchar)*data++];
+	}
+#endif
+	while (data < end) {
+		char escape = escape_table[(guchar)*data];
+		if (escape) {
+			*p++ = '\\';
+			*p++ = escape;
+		} else {
+			*p++ = *data;
+		}
+		data++;
+	}
+	return p;
+}
+
+/* Escaped, double quoted string */
+gsize format_string(GString *statement, const char *data, gulong length) {
+	char *start = statement_reserve(statement, length*2+2);
+	char *p = start;
+
+	*p++ = '"';
+	p = escape_string(p, data, length);
+	*p++ = '"';
+
+	statement_commit(statement, p);
+	return p - start;
+}
+
+/* Part of a cell between its opening and closing (quotes or 0x), so big cells can be formatted in pieces */
+static void format_cell_piece(field_formatter formatter, GString *statement, const char *data, gulong length) {
+	if (formatter == format_hex) {
+		hex_digits(statement_reserve(statement, length*2), data, length);
+	} else if (formatter == format_string) {
+		char *p = statement_reserve(statement, length*2);
+		statement_commit(statement, escape_string(p, data, length));
+	} else {
+		format_numeric(statement, data, length);
+	}
+}
+
+gsize format_null(GString *statement, const char *data, gulong length) {
+	(void) data;
+	(void) length;
+	g_string_append_len(statement, "NULL", 4);
+	return 4;
+}
+
+field_formatter get_field_formatter(MYSQL_FIELD *field) {
+	switch (field->type) {
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_DECIMAL:
+		case MYSQL_TYPE_NEWDECIMAL:
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+		case MYSQL_TYPE_YEAR:
+			return format_numeric;
+		case MYSQL_TYPE_BIT:
+			return format_hex;
+		case MYSQL_TYPE_TINY_BLOB:
+		case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB:
+		case MYSQL_TYPE_BLOB:
+		case MYSQL_TYPE_STRING:
+		case MYSQL_TYPE_VAR_STRING:
+		case MYSQL_TYPE_GEOMETRY:
+			/* BLOB, BINARY and VARBINARY carry BINARY_FLAG, TEXT and CHAR with non-binary collations don't */
+			if (field->flags & BINARY_FLAG)
+				return format_hex;
+			return format_string;
+		default:
+			return format_string;
+	}
+}
+
+/* Start formatting batch from its first row */
+void batch_cursor_init(struct batch_cursor *cursor, struct row_batch *batch) {
+	cursor->cell = batch->data->str;
+	cursor->length = (gulong *)batch->lengths->data;
+	cursor->row = 0;
+}
+
+/*
+ * Append rows from cursor on to statement, starting a new INSERT whenever statement is empty.
+ * Returns TRUE once a statement grew over statement_size and got closed, it has to be handed off before
+ * formatting continues with an empty statement. Returns FALSE when the batch is used up
+ */
+gboolean format_rows(struct row_format *format, struct row_batch *batch, struct batch_cursor *cursor, GString *statement) {
+	guint i;
+
+	while (cursor->row < batch->rows) {
+		cursor->row++;
+
+		if (!statement->len)
+			g_string_printf(statement, "INSERT INTO `%s` VALUES\n (", format->table);
+		else
+			g_string_append(statement, ",\n (");
+
+		for (i = 0; i < format->num_fields; i++, cursor->length++) {
+			if (*cursor->length == G_MAXULONG) {
+				format_null(statement, NULL, 0);
+			} else {
+				format->formatters[i](statement, cursor->cell, *cursor->length);
+				cursor->cell += *cursor->length;
+			}
+			if (i < format->num_fields - 1)
+				g_string_append_c(statement, ',');
+		}
+
+		/* INSERT statement is closed once over limit */
+		if (statement->len > format->statement_size) {
+			g_string_append(statement, ");\n");
+			return TRUE;
+		}
+		g_string_append_c(statement, ')');
+	}
+	return FALSE;
+}
+
+void piece_cursor_init(struct piece_cursor *cursor) {
+	cursor->started = FALSE;
+	cursor->done = FALSE;
+	cursor->field = 0;
+	cursor->offset = 0;
+}
+
+/*
+ * Append one row to statement without ever formatting more than FORMAT_PIECE_SIZE bytes of a cell at once.
+ * Returns TRUE whenever statement grew over statement_size, it has to be handed off before formatting goes on
+ * with an empty one; while cursor is not done that is in the middle of the row. The row always closes its
+ * statement, it may have started in an earlier buffer. Returns FALSE once the row is done
+ */
+gboolean format_row_pieces(struct row_format *format, MYSQL_ROW row, const gulong *lengths, struct piece_cursor *cursor, GString *statement) {
+	if (cursor->done)
+		return FALSE;
+	if (!cursor->started) {
+		if (!statement->len)
+			g_string_printf(statement, "INSERT INTO `%s` VALUES\n (", format->table);
+		else
+			g_string_append(statement, ",\n (");
+		cursor->started = TRUE;
+	}
+
+	while (cursor->field < format->num_fields) {
+		guint i = cursor->field;
+		field_formatter formatter = format->formatters[i];
+		gulong length = lengths[i];
+
+		if (!cursor->offset) {
+			if (i)
+				g_string_append_c(statement, ',');
+			if (!row[i] || length <= FORMAT_PIECE_SIZE) {
+				if (!row[i])
+					format_null(statement, NULL, 0);
+				else
+					formatter(statement, row[i], length);
+				cursor->field++;
+				if (cursor->field < format->num_fields && statement->len > format->statement_size)
+					return TRUE;
+				continue;
+			}
+			g_string_append(statement, formatter == format_hex ? "0x" : formatter == format_string ? "\"" : "");
+		}
+
+		gulong piece = MIN(FORMAT_PIECE_SIZE, length - cursor->offset);
+		format_cell_piece(formatter, statement, row[i] + cursor->offset, piece);
+		cursor->offset += piece;
+		if (cursor->offset < length) {
+			if (statement->len > format->statement_size)
+				return TRUE;
+			continue;
+		}
+
+		if (formatter == format_string)
+			g_string_append_c(statement, '"');
+		cursor->field++;
+		cursor->offset = 0;
+		if (cursor->field < format->num_fields && statement->len > format->statement_size)
+			return TRUE;
+	}
+
+	g_string_append(statement, ");\n");
+	cursor->done = TRUE;
+	return TRUE;
+}
+
+/* Close a pending statement at the end of a result set */
+void format_finish(GString *statement) {
+	if (statement->len)
+		g_string_append(statement, ";\n");
+}
@@ -0,0 +1,77 @@
+#ifndef _format_h
+#define _format_h
+
+#include <mysql.h>
+#include <glib.h>
+
+/* Appends one non-NULL cell to statement, returns bytes appended */
+typedef gsize (*field_formatter)(GString *statement, const char *data, gulong length);
+
+enum batch_type { BATCH_ROWS, BATCH_LARGE_ROW, BATCH_END, BATCH_SHUTDOWN };
+
+/*
+ * Rows copied out of the client library by the fetch stage, NULL cells have length G_MAXULONG.
+ * A BATCH_LARGE_ROW carries a single row too big to copy, still in the client library's buffer
+ */
+struct row_batch {
+	enum batch_type type;
+	GString *data;
+	GArray *lengths;
+	guint rows;
+	MYSQL_ROW row;
+	gulong *row_lengths;
+	/* Memory taken for the statement the huge row is put together into, freed by whoever runs it */
+	guint64 reserved;
+};
+
+/* Input bytes of a big cell formatted in one piece */
+#define FORMAT_PIECE_SIZE (64*1024)
+
+/* How rows of one result set are turned into INSERT statements */
+struct row_format {
+	const char *table;
+	guint num_fields;
+	field_formatter *formatters;
+	gsize statement_size;
+};
+
+/* Next row of a batch to be formatted */
+struct batch_cursor {
+	const gchar *cell;
+	const gulong *length;
+	guint row;
+};
+
+/* Position within a row formatted piece by piece */
+struct piece_cursor {
+	gboolean started;
+	gboolean done;
+	guint field;
+	gulong offset;
+};
+
+gsize format_numeric(GString *statement, const char *data, gulong length);
+gsize format_hex(GString *statement, const char *data, gulong length);
+gsize format_string(GString *statement, const char *data, gulong length);
+gsize format_null(GString *statement, const char *data, gulong length);
+field_formatter get_field_formatter(MYSQL_FIELD *field);
+
+void batch_cursor_init(struct batch_cursor *cursor, struct row_batch *batch);
+gboolean format_rows(struct row_format *format, struct row_batch *batch, struct batch_cursor *cursor, GString *statement);
+void piece_cursor_init(struct piece_cursor *cursor);
+gboolean format_row_pieces(struct row_format *format, MYSQL_ROW row, const gulong *lengths, struct piece_cursor *cursor, GString *statement);
+void format_finish(GString *statement);
+
+/* Copy one cell into batch, data NULL for a NULL cell. Called per cell, so it stays inline */
+static inline void batch_add_cell(struct row_batch *batch, const char *data, gulong length) {
+	static const gulong null_length = G_MAXULONG;
+
+	if (!data) {
+		g_array_append_val(batch->lengths, null_length);
+	} else {
+		g_string_append_len(batch->data, data, length);
+		g_array_append_val(batch->lengths, length);
+	}
+}
+
+#endif
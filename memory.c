@@ -0,0 +1,74 @@
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <glib.h>
+#include "memory.h"
+
+static GMutex *memory_mutex = NULL;
+static GCond *memory_cond = NULL;
+static guint64 memory_limit = 0;
+/* Everything reserved, and the part of it that is pipeline buffers held until their worker ends */
+static guint64 memory_used = 0;
+static guint64 memory_buffers = 0;
+
+void memory_init(guint64 limit) {
+	memory_limit = limit;
+	memory_mutex = g_mutex_new();
+	memory_cond = g_cond_new();
+}
+
+/* Buffers are taken for good, so they never wait: FALSE when they don't fit the budget at all */
+gboolean memory_reserve_buffers(guint64 bytes) {
+	gboolean fits;
+
+	g_mutex_lock(memory_mutex);
+	fits = !memory_limit || memory_used + bytes <= memory_limit;
+	if (fits) {
+		memory_used += bytes;
+		memory_buffers += bytes;
+	}
+	g_mutex_unlock(memory_mutex);
+	return fits;
+}
+
+void memory_release_buffers(guint64 bytes) {
+	g_mutex_lock(memory_mutex);
+	memory_used -= bytes;
+	memory_buffers -= bytes;
+	g_cond_broadcast(memory_cond);
+	g_mutex_unlock(memory_mutex);
+}
+
+/*
+ * Wait until bytes fit the budget. A request larger than whatever buffers leave over goes through once it is alone,
+ * so it is slow rather than stuck. Callers hold no other transient reservation while they wait, nothing deadlocks
+ */
+void memory_reserve(guint64 bytes) {
+	if (!bytes)
+		return;
+	g_mutex_lock(memory_mutex);
+	while (memory_limit && memory_used + bytes > memory_limit && memory_used > memory_buffers)
+		g_cond_wait(memory_cond, memory_mutex);
+	memory_used += bytes;
+	g_mutex_unlock(memory_mutex);
+}
+
+void memory_release(guint64 bytes) {
+	if (!bytes)
+		return;
+	g_mutex_lock(memory_mutex);
+	memory_used -= bytes;
+	g_cond_broadcast(memory_cond);
+	g_mutex_unlock(memory_mutex);
+}
+
+guint64 memory_reserved(void) {
+	guint64 used;
+
+	if (!memory_mutex)
+		return 0;
+	g_mutex_lock(memory_mutex);
+	used = memory_used;
+	g_mutex_unlock(memory_mutex);
+	return used;
+}
@@ -0,0 +1,17 @@
+#ifndef _memory_h
+#define _memory_h
+
+#include <glib.h>
+
+/*
+ * Process-wide budget for --memory-limit. Pipeline buffers are reserved once per worker and have to fit,
+ * transient reservations (huge rows) wait until other threads give memory back. A limit of 0 means no limit.
+ */
+void memory_init(guint64 limit);
+gboolean memory_reserve_buffers(guint64 bytes);
+void memory_release_buffers(guint64 bytes);
+void memory_reserve(guint64 bytes);
+void memory_release(guint64 bytes);
+guint64 memory_reserved(void);
+
+#endif
@@ -9,16 +9,34 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <time.h>
-#include <zlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <pcre.h>
 #include <glib/gstdio.h>
+#include "compress.h"
+#include "format.h"
+#include "binlog.h"
+#include "stats.h"
+#include "trace.h"
+#include "memory.h"
 
 struct configuration {
 	char use_any_index;
 	GAsyncQueue *queue;
 	GAsyncQueue *ready;
+	/* Tells connected workers to start (or start over) their snapshot, or to go on with dumping */
+	GAsyncQueue *start;
 	GMutex *mutex;
 	int done;
+	/* Jobs with integer ranges currently being dumped, idle workers steal from these */
+	GList *running;
+	/* Planned jobs not handed to workers yet, ordered biggest first */
+	GTree *pending;
+	/* Workers out of queued jobs, left to steal from running ones */
+	guint idle;
 };
 
 /* Database options */
@@ -38,18 +56,47 @@ guint num_threads = 4;
 gchar *directory = NULL;
 guint statement_size = 1000000;
 guint rows_per_file = 0;
+guint chunk_filesize = 0;
 int longquery = 60;
 int build_empty_files=0;
 
 int need_dummy_read=0;
 int compress_output=0;
+gchar *compress_codec=NULL;
+guint compress_threads=0;
+enum codec output_codec=CODEC_NONE;
+int direct_io=0;
 int killqueries=0;
+int resume=0;
+gchar *incremental_from=NULL;
+gchar *differential_from=NULL;
+int stream_output=0;
+gchar *stats_file=NULL;
+guint stats_interval=10;
+guint memory_limit=0;
+gchar *trace_file=NULL;
+gchar *lock_mode_name=NULL;
+gchar *replicas_list=NULL;
+gchar *instances_file=NULL;
+
+/* Clone mode: rows go straight into this server instead of files */
+char *target_host=NULL;
+char *target_user=NULL;
+char *target_password=NULL;
+char *target_socket=NULL;
+guint target_port=3306;
+int target_drop_tables=0;
+int clone_output=0;
+MYSQL *target_conn=NULL;
+/* max_allowed_packet of the clone target, no statement run there may be larger */
+guint64 target_max_packet=0;
 
 gchar *ignore_engines = NULL;
-char **ignore = NULL;
+/* Case insensitive name sets, membership is all filtering needs */
+GHashTable *ignore = NULL;
 
 gchar *tables_list = NULL;
-char **tables = NULL;
+GHashTable *tables = NULL;
 
 static GOptionEntry entries[] =
 {
@@ -64,37 +111,281 @@ static GOptionEntry entries[] =
 	{ "outputdir", 'o', 0, G_OPTION_ARG_FILENAME, &directory, "Directory to output files to, default ./" DIRECTORY"-*/",  NULL },
 	{ "statement-size", 's', 0, G_OPTION_ARG_INT, &statement_size, "Attempted size of INSERT statement in bytes", NULL},
 	{ "rows", 'r', 0, G_OPTION_ARG_INT, &rows_per_file, "Try to split tables into chunks of this many rows", NULL},
+	{ "chunk-filesize", 'F', 0, G_OPTION_ARG_INT, &chunk_filesize, "Roll over to a new file once this many MB (uncompressed) are written", NULL},
 	{ "compress", 'c', 0, G_OPTION_ARG_NONE, &compress_output, "Compress output files", NULL},
+	{ "compress-codec", 0, 0, G_OPTION_ARG_STRING, &compress_codec, "Compression codec: gzip (default), zstd or lz4, implies --compress", NULL},
+	{ "compress-threads", 0, 0, G_OPTION_ARG_INT, &compress_threads, "Number of compression threads, defaults to --threads", NULL},
+	{ "direct-io", 0, 0, G_OPTION_ARG_NONE, &direct_io, "Write output with O_DIRECT (asynchronously through io_uring if built WITH_IO_URING), bypassing the page cache", NULL},
 	{ "build-empty-files", 'e', 0, G_OPTION_ARG_NONE, &build_empty_files, "Build dump files even if no data available from table", NULL},
 	{ "regex", 'x', 0, G_OPTION_ARG_STRING, &regexstring, "Regular expression for 'db.table' matching", NULL},
 	{ "ignore-engines", 'i', 0, G_OPTION_ARG_STRING, &ignore_engines, "Comma delimited list of storage engines to ignore", NULL },
 	{ "long-query-guard", 'l', 0, G_OPTION_ARG_INT, &longquery, "Set long query timer (60s by default)", NULL },
 	{ "kill-long-queries", 'k', 0, G_OPTION_ARG_NONE, &killqueries, "Kill long running queries (instead of aborting)", NULL },
+	{ "resume", 0, 0, G_OPTION_ARG_NONE, &resume, "Resume an interrupted dump in --outputdir, only unfinished chunks are dumped", NULL },
+	{ "incremental", 0, 0, G_OPTION_ARG_FILENAME, &incremental_from, "Only dump rows changed since the dump in this directory, read from the binary log", NULL },
+	{ "stream", 0, 0, G_OPTION_ARG_NONE, &stream_output, "Write all files as one multiplexed stream to standard output, restore it with myloader --stream", NULL },
+	{ "differential", 0, 0, G_OPTION_ARG_FILENAME, &differential_from, "Hard link chunks whose checksum did not change since the dump in this directory (same filesystem) instead of dumping them", NULL },
+	{ "stats-file", 0, 0, G_OPTION_ARG_FILENAME, &stats_file, "Periodically write progress metrics in Prometheus text format to this file", NULL },
+	{ "stats-interval", 0, 0, G_OPTION_ARG_INT, &stats_interval, "Seconds between --stats-file updates, default 10", NULL },
+	{ "lock-mode", 0, 0, G_OPTION_ARG_STRING, &lock_mode_name, "How snapshots are synchronized: auto (default), ftwrl, or gtid for InnoDB-only servers with GTIDs, without a global read lock", NULL },
+	{ "target-host", 0, 0, G_OPTION_ARG_STRING, &target_host, "Clone into this server instead of writing files, tables are created from SHOW CREATE TABLE", NULL },
+	{ "target-port", 0, 0, G_OPTION_ARG_INT, &target_port, "TCP/IP port of the clone target", NULL },
+	{ "target-socket", 0, 0, G_OPTION_ARG_STRING, &target_socket, "UNIX domain socket of the clone target, clones into a local server", NULL },
+	{ "target-user", 0, 0, G_OPTION_ARG_STRING, &target_user, "Username on the clone target, defaults to --user", NULL },
+	{ "target-password", 0, 0, G_OPTION_ARG_STRING, &target_password, "Password on the clone target, defaults to --password", NULL },
+	{ "target-drop-tables", 0, 0, G_OPTION_ARG_NONE, &target_drop_tables, "Drop tables that already exist on the clone target, they are left alone and skipped otherwise", NULL },
+	{ "memory-limit", 0, 0, G_OPTION_ARG_INT, &memory_limit, "Memory budget in MB for row buffers of all threads, threads wait for each other on huge rows once it is used up", NULL },
+	{ "trace-file", 0, 0, G_OPTION_ARG_FILENAME, &trace_file, "Write per-thread phase timings in Chrome trace-event JSON to this file", NULL },
+	{ "instances", 0, 0, G_OPTION_ARG_FILENAME, &instances_file, "Dump every instance of this key file in a process of its own under --outputdir, starting them while their threads keys fit into --threads", NULL },
+	{ "replicas", 0, 0, G_OPTION_ARG_STRING, &replicas_list, "Comma delimited host[:port] list of more replicas of the same source, threads read from --host and these, all paused at one replication position", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE,   NULL, NULL, NULL }
 };
 
 enum job_type { JOB_SHUTDOWN, JOB_DUMP };
 
+/* auto takes GTID synchronized snapshots wherever the server allows, FTWRL otherwise. --replicas pauses replication instead */
+enum lock_mode { LOCK_AUTO, LOCK_FTWRL, LOCK_GTID, LOCK_REPLICAS };
+enum lock_mode lock_mode = LOCK_AUTO;
+/* LOCK INSTANCE FOR BACKUP is held for the whole dump */
+int backup_locked = 0;
+
+enum snapshot_request { SNAPSHOT_START = 1, SNAPSHOT_DONE };
+
+/* Times snapshots are started over when a commit slipped in between them */
+#define GTID_SYNC_ATTEMPTS 10
+
+/* Worker connections of an --instances instance without a threads key */
+#define INSTANCE_THREADS 4
+
+/* Seconds a lagging replica gets to catch up with the most advanced one */
+#define REPLICA_SYNC_TIMEOUT 600
+
+/* Server threads read from with --replicas, the first one is --host and shares the main connection */
+struct replica {
+	char *host;
+	guint port;
+	char *socket;
+	/* Control connection, replication is paused and resumed through it */
+	MYSQL *conn;
+	gboolean sql_running;
+	/* Position the SQL thread stopped at, executed GTID set or source binary log coordinates */
+	gchar *gtid;
+	gchar *master_host;
+	gchar *master_log;
+	guint64 master_pos;
+};
+
+GPtrArray *replicas = NULL;
+/* Replicas are handed to connecting workers round robin */
+gint next_replica = 0;
+/* Replication stays paused for the whole dump when non-transactional tables are read */
+int replicas_paused = 0;
+
+/* A slice, 1/RANGE_SLICES of a range job, is the smallest piece that is claimed or stolen */
+#define RANGE_SLICES 16
+
+/*
+ * Integer key range dumped slice by slice. cursor is the progress key (everything below it is claimed),
+ * stealing lowers upper. Both are protected by conf->mutex
+ */
+struct chunk_range {
+	char *field;
+	guint64 lower;
+	guint64 cursor;
+	guint64 upper;
+	guint64 slice;
+	gboolean nulls;
+	guint steals;
+	/* Pieces stolen from this range in the previous dump (--differential), file names of new ones go on after them */
+	guint stolen_before;
+};
+
+/* Planned piece of a table, either a static WHERE clause or a stealable integer range */
+struct chunk {
+	char *where;
+	struct chunk_range *range;
+	/* File of the previous dump's chunk this one repeats, numbered like any other chunk when NULL */
+	char *filename;
+};
+
+/* Partition (or subpartition) of a partitioned table, as listed in information_schema.PARTITIONS */
+struct partition {
+	char *name;
+	guint64 data_length;
+	guint64 rows;
+};
+
 struct job {
 	enum job_type type;
 	char *database;
 	char *table;
+	/* Read through SELECT ... PARTITION (partition) when set */
+	char *partition;
 	char *filename;
 	char *where;
+	struct chunk_range *range;
+	/* Estimated amount of data, used for scheduling, and estimated rows for progress reporting */
+	guint64 bytes;
+	guint64 rows;
+	/* --differential: expression checksummed per row, and checksum of the rows this job dumps */
+	char *checksum_columns;
+	char *checksum;
 	struct configuration *conf;
 };
 
+/* Chunk as last recorded in a manifest */
+struct manifest_entry {
+	char *database;
+	char *table;
+	char *partition;
+	char *where;
+	guint64 bytes;
+	gboolean done;
+	guint64 rows;
+	char *checksum;
+};
+
+/* Balanced chunks may be off by 1/BALANCE_SLACK of --rows, bisection gives up after BALANCE_MAX_ITERATIONS */
+#define BALANCE_SLACK 10
+#define BALANCE_MAX_ITERATIONS 32
+
+/* Depth of the bounded queues between pipeline stages */
+#define PIPELINE_DEPTH 4
+
+/* Complete INSERT statements handed from the format stage to the write stage, or part of one huge row */
+struct write_buffer {
+	enum batch_type type;
+	GString *data;
+	/* Statement goes on in the next buffer */
+	gboolean partial;
+	/* Last piece of a huge row in clone mode: memory taken for the whole statement */
+	guint64 reserved;
+};
+
+/*
+ * Per-connection fetch -> format -> write pipeline.
+ * The worker thread itself is the fetch stage, format and write stages get their own threads
+ * and buffers cycle between free and full queues, so at most PIPELINE_DEPTH of each are in flight.
+ */
+struct pipeline {
+	MYSQL *conn;
+	GAsyncQueue *free_batches;
+	GAsyncQueue *batches;
+	GAsyncQueue *free_buffers;
+	GAsyncQueue *buffers;
+	GAsyncQueue *done;
+	/* Large rows come back here once formatted, their data belongs to the client library until the next fetch */
+	GAsyncQueue *row_done;
+	GThread *format_thread;
+	GThread *write_thread;
+	/* Current output, set up by fetch stage per file and rotated by write stage on --chunk-filesize */
+	struct output_file *file;
+	char *filename;
+	guint part;
+	guint64 written;
+	/* Write stage is in the middle of a statement, no place to roll over */
+	gboolean continued;
+	/* Write stage lost output of the current job, it must not be marked done */
+	gboolean failed;
+	/* Clone mode: connection to the target and a statement spanning buffers, put together before it is run */
+	MYSQL *target;
+	GString *statement;
+	/* Current table, set by fetch stage before first batch of every table */
+	struct row_format format;
+	struct worker_stats *stats;
+};
+
 struct tm tval;
 
-void dump_table(MYSQL *conn, char *database, char *table, struct configuration *conf);
-guint64 dump_table_data(MYSQL *, FILE *, char *, char *, char *);
-void dump_database(MYSQL *, char *, struct configuration *conf);
-GList * get_chunks_for_table(MYSQL *, char *, char *, struct configuration *conf);
-guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, char *from, char *to);
-void dump_table_data_file(MYSQL *conn, char *database, char *table, char *where, char *filename);
+FILE *manifest = NULL;
+GMutex *manifest_mutex = NULL;
+/* Jobs that didn't make it into the dump, any of them fails the run */
+gint failed_jobs = 0;
+/* Manifest of the dump given to --differential, and its file names grouped by "database.table" */
+GHashTable *previous_chunks = NULL;
+GHashTable *previous_tables = NULL;
+/* --stream keeps .metadata in memory until it is written as the last file of the stream */
+char *metadata_buffer = NULL;
+size_t metadata_size = 0;
+
+void dump_table(MYSQL *conn, char *database, char *table, guint64 data_length, guint64 table_rows, gboolean partitioned, struct configuration *conf);
+guint dump_table_chunks(MYSQL *conn, char *database, char *table, char *partition, guint64 data_length, guint64 table_rows, char *checksum_columns,
+	GPtrArray *previous, guint nchunk, struct configuration *conf);
+GHashTable *index_previous_chunks(GHashTable *chunks);
+gboolean previous_ranges_usable(GPtrArray *previous, char *database, char *table, guint *next);
+GList *get_previous_chunks(MYSQL *conn, char *database, char *table, char *partition, GPtrArray *previous);
+gboolean parse_range_where(const char *where, gchar **field, guint64 *lower, guint64 *upper, gboolean *nulls);
+GList *get_range_chunks(MYSQL *conn, char *database, char *table, char *partition, char *field, guint64 cutoff, guint64 nmax, guint64 rows, gboolean nulls);
+GList *get_partitions(MYSQL *conn, char *database, char *table);
+gchar *table_source(char *database, char *table, char *partition);
+gint job_size_compare(gconstpointer a, gconstpointer b);
+void release_jobs(struct configuration *conf, guint64 bound);
+guint64 dump_table_data(MYSQL *, struct pipeline *, char *, char *, char *, char *);
+void dump_catalog(MYSQL *conn, struct configuration *conf);
+GList * get_chunks_for_table(MYSQL *, char *, char *, char *, struct configuration *conf);
+GList * get_chunks_by_boundaries(MYSQL *conn, char *database, char *table, char *partition, char *index, GPtrArray *columns);
+guint64 estimate_count(MYSQL *conn, char *database, char *table, char *partition, char *field, char *from, char *to);
+guint64 get_balanced_cutoff(MYSQL *conn, char *database, char *table, char *partition, char *field, guint64 from, guint64 nmax);
+void dump_table_data_file(MYSQL *conn, struct pipeline *pl, struct job *job);
+guint64 dump_table_range(MYSQL *conn, struct pipeline *pl, struct job *job);
+gchar *filename_part(const char *filename, guint part);
+gsize write_file_header(struct output_file *file);
+gchar *stolen_filename(struct job *job);
+struct job *steal_job(struct configuration *conf);
+void free_job(struct job *job);
+guint64 pipeline_memory(void);
+struct pipeline *pipeline_new(MYSQL *conn);
+void pipeline_free(struct pipeline *pl);
+void *format_stage(struct pipeline *pl);
+void *write_stage(struct pipeline *pl);
+gchar *sql_literal(MYSQL *conn, MYSQL_FIELD *field, const char *value, gulong length);
 void create_backup_dir(char *directory);
-int write_data(void *file,GString *);
+int write_data(struct output_file *file,GString *);
+MYSQL *connect_target(void);
+gboolean clone_schema(MYSQL *conn, char *database, char *table);
+void clone_write(struct pipeline *pl, struct write_buffer *buffer);
 gboolean check_regex(char *database, char *table);
+gboolean table_selected(char *database, char *table, char *engine);
+GHashTable *name_set(const char *list);
+void manifest_complete(void);
+gchar *get_snapshot_info(MYSQL *conn);
+gchar *get_slave_info(MYSQL *conn);
+gchar *get_log_status(MYSQL *conn, gchar **gtid);
+gchar *get_gtid_executed(MYSQL *conn);
+gboolean gtid_snapshot_possible(MYSQL *conn);
+gchar *start_snapshot(MYSQL *conn, gboolean gtid, gchar **snapshot_info);
+gboolean start_worker_snapshots(struct configuration *conf, const gchar *expected);
+gchar *start_snapshots(MYSQL *conn, struct configuration *conf, gchar **lock_info);
+gboolean innodb_only(MYSQL *conn);
+void parse_replicas(MYSQL *conn);
+gboolean read_replica_position(struct replica *r, gboolean gtid, gboolean *sql_running);
+gboolean gtid_subset(MYSQL *conn, const gchar *a, const gchar *b);
+gboolean replica_at(MYSQL *conn, struct replica *r, struct replica *target, gboolean gtid);
+gchar *sync_replicas(MYSQL *conn, struct configuration *conf, gchar **lock_info);
+void resume_replicas(void);
+void resume_replicas_at_exit(void);
+void catch_signals(void);
+gchar *instance_string(GKeyFile *keyfile, const gchar *group, const gchar *key, gchar *fallback);
+void setup_instance(GKeyFile *keyfile, const gchar *group, guint threads);
+void run_instances(void);
+gchar *range_where(char *field, guint64 lower, guint64 upper, gboolean nulls);
+void manifest_open(gboolean append);
+void manifest_close(void);
+void manifest_sync(void);
+gchar *job_where(struct job *job);
+void manifest_planned(struct job *job);
+void manifest_done(struct job *job, guint64 rows, guint64 bytes);
+void resume_jobs(struct configuration *conf);
+GHashTable *read_manifest(const char *dir, gboolean *complete);
+void free_manifest_entry(struct manifest_entry *e);
+gchar *chunk_checksum(MYSQL *conn, struct job *job);
+gboolean link_previous_chunk(struct job *job);
+gchar *get_checksum_columns(MYSQL *conn, char *database, char *table);
+guint64 job_output_bytes(struct job *job, guint parts);
+gboolean read_master_status(const char *dir, char **file, guint64 *pos);
+gboolean incremental_filter(char *database, char *table);
+int dump_incremental(MYSQL *conn, FILE *mdfile);
+void close_metadata(FILE *mdfile);
 
 /*
  * Check database.table string against regular expression
@@ -102,54 +393,142 @@ gboolean check_regex(char *database, char *table);
 gboolean check_regex(char *database, char *table) {
 	/* This is not going to be used in threads */
 	static pcre *re = NULL;
+	static pcre_extra *extra = NULL;
+	static GString *name = NULL;
 	int rc;
 	int ovector[9];
 	const char *error;
 	int erroroffset;
 
-	char *p;
-
-	/* Let's compile the RE before we do anything */
+	/* Let's compile the RE before we do anything, JIT compiled where libpcre supports it */
 	if (!re) {
 		re = pcre_compile(regexstring,PCRE_CASELESS|PCRE_MULTILINE,&error,&erroroffset,NULL);
 		if(!re) {
 			g_critical("Regular expression fail: %s", error);
 			exit(EXIT_FAILURE);
 		}
+#ifdef PCRE_STUDY_JIT_COMPILE
+		extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+#else
+		extra = pcre_study(re, 0, &error);
+#endif
+		name = g_string_sized_new(128);
 	}
 
-	p=g_strdup_printf("%s.%s",database,table);
-	rc = pcre_exec(re,NULL,p,strlen(p),0,0,ovector,9);
-	g_free(p);
+	g_string_assign(name, database);
+	g_string_append_c(name, '.');
+	g_string_append(name, table);
+	rc = pcre_exec(re,extra,name->str,name->len,0,0,ovector,9);
 
 	return (rc>0)?TRUE:FALSE;
 }
 
+/* Database, --tables-list, --ignore-engines and --regex selection, engine is NULL where it isn't known */
+gboolean table_selected(char *database, char *table, char *engine) {
+	if (db ? strcmp(database, db) : !strcmp(database, "information_schema"))
+		return FALSE;
+	/* Skip ignored engines, handy for avoiding Merge, Federated or Blackhole :-) dumps */
+	if (engine && ignore && g_hash_table_lookup(ignore, engine))
+		return FALSE;
+	if (tables && !g_hash_table_lookup(tables, table))
+		return FALSE;
+	/* Checks PCRE expressions on 'database.table' string */
+	if (regexstring && !check_regex(database, table))
+		return FALSE;
+	return TRUE;
+}
+
+static guint ascii_strcase_hash(gconstpointer v) {
+	const char *p;
+	guint h = 5381;
+
+	for (p = v; *p; p++)
+		h = (h << 5) + h + g_ascii_tolower(*p);
+	return h;
+}
+
+static gboolean ascii_strcase_equal(gconstpointer a, gconstpointer b) {
+	return !g_ascii_strcasecmp(a, b);
+}
+
+/* Comma delimited list as a case insensitive set */
+GHashTable *name_set(const char *list) {
+	GHashTable *set = g_hash_table_new_full(ascii_strcase_hash, ascii_strcase_equal, g_free, NULL);
+	gchar **names = g_strsplit(list, ",", 0);
+	guint i;
+
+	for (i = 0; names[i]; i++)
+		g_hash_table_insert(set, names[i], GINT_TO_POINTER(1));
+	/* Set owns the strings now */
+	g_free(names);
+	return set;
+}
+
 /*
  * Write some stuff we know about snapshot, before it changes
  */
 void write_snapshot_info(MYSQL *conn, FILE *file) {
-	MYSQL_RES *master=NULL, *slave=NULL;
+	gchar *info = get_snapshot_info(conn);
+	fputs(info, file);
+	fflush(file);
+	g_free(info);
+}
+
+/* Binlog coordinates of the snapshot, in the form they are kept in .metadata */
+gchar *get_snapshot_info(MYSQL *conn) {
+	GString *info = g_string_new("");
+	MYSQL_RES *master=NULL;
 	MYSQL_FIELD *fields;
 	MYSQL_ROW row;
 
 	char *masterlog=NULL;
 	char *masterpos=NULL;
-
-	char *slavehost=NULL;
-	char *slavelog=NULL;
-	char *slavepos=NULL;
+	gchar *mastergtid=NULL;
 
 	mysql_query(conn,"SHOW MASTER STATUS");
 	master=mysql_store_result(conn);
+	guint i;
 	if (master && (row=mysql_fetch_row(master))) {
 		masterlog=row[0];
 		masterpos=row[1];
+		fields=mysql_fetch_fields(master);
+		for (i=0; i<mysql_num_fields(master); i++) {
+			/* Set is wrapped over several lines for many server UUIDs */
+			if (!strcasecmp("executed_gtid_set", fields[i].name) && row[i] && row[i][0])
+				mastergtid=g_strdelimit(g_strdup(row[i]), "\n", ' ');
+		}
+	}
+
+	if (masterlog) {
+		g_string_append_printf(info, "SHOW MASTER STATUS:\n\tLog: %s\n\tPos: %s\n", masterlog, masterpos);
+		if (mastergtid)
+			g_string_append_printf(info, "\tGTID: %s\n", mastergtid);
+		g_string_append_c(info, '\n');
 	}
+	g_free(mastergtid);
+	if (master)
+		mysql_free_result(master);
+
+	gchar *slave_info = get_slave_info(conn);
+	g_string_append(info, slave_info);
+	g_free(slave_info);
+	return g_string_free(info, FALSE);
+}
+
+/* Replication coordinates when conn is a replica, the .metadata part after the binary log coordinates */
+gchar *get_slave_info(MYSQL *conn) {
+	GString *info = g_string_new("");
+	MYSQL_RES *slave=NULL;
+	MYSQL_FIELD *fields;
+	MYSQL_ROW row;
+	guint i;
+
+	char *slavehost=NULL;
+	char *slavelog=NULL;
+	char *slavepos=NULL;
 
 	mysql_query(conn, "SHOW SLAVE STATUS");
 	slave=mysql_store_result(conn);
-	guint i;
 	if (slave && (row=mysql_fetch_row(slave))) {
 		fields=mysql_fetch_fields(slave);
 		for (i=0; i<mysql_num_fields(slave);i++) {
@@ -163,58 +542,564 @@ void write_snapshot_info(MYSQL *conn, FILE *file) {
 		}
 	}
 
-	if (masterlog)
-		fprintf(file, "SHOW MASTER STATUS:\n\tLog: %s\n\tPos: %s\n\n", masterlog, masterpos);
-
 	if (slavehost)
-		fprintf(file, "SHOW SLAVE STATUS:\n\tHost: %s\n\tLog: %s\n\tPos: %s\n\n",
+		g_string_append_printf(info, "SHOW SLAVE STATUS:\n\tHost: %s\n\tLog: %s\n\tPos: %s\n\n",
 			slavehost, slavelog, slavepos);
 
-	fflush(file);
-	if (master)
-		mysql_free_result(master);
 	if (slave)
 		mysql_free_result(slave);
+	return g_string_free(info, FALSE);
+}
+
+/*
+ * Binary log coordinates in .metadata form and gtid_executed (into gtid), taken by the server with commits blocked so
+ * both describe the same transactions. SHOW MASTER STATUS can be ahead of gtid_executed: a transaction is in the
+ * binary log before it commits. NULL without performance_schema.log_status (MySQL 8.0.14 and later, BACKUP_ADMIN)
+ */
+gchar *get_log_status(MYSQL *conn, gchar **gtid) {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	gchar *info = NULL;
+
+	if (mysql_query(conn, "SELECT LOCAL->>'$.binary_log_file', LOCAL->>'$.binary_log_position', LOCAL->>'$.gtid_executed'"
+			" FROM performance_schema.log_status") || !(res = mysql_store_result(conn)))
+		return NULL;
+	if ((row = mysql_fetch_row(res)) && row[0] && row[0][0] && row[1] && row[2]) {
+		*gtid = g_strdup(row[2]);
+		/* Set is wrapped over several lines for many server UUIDs */
+		gchar *set = g_strdelimit(g_strdup(row[2]), "\n", ' ');
+		info = g_strdup_printf("SHOW MASTER STATUS:\n\tLog: %s\n\tPos: %s\n%s%s%s\n", row[0], row[1],
+			set[0] ? "\tGTID: " : "", set, set[0] ? "\n" : "");
+		g_free(set);
+	}
+	mysql_free_result(res);
+	return info;
+}
+
+/* Transactions committed so far, empty without GTID support */
+gchar *get_gtid_executed(MYSQL *conn) {
+	gchar *gtid = NULL;
+
+	if (!mysql_query(conn, "SELECT @@GLOBAL.gtid_executed")) {
+		MYSQL_RES *res = mysql_store_result(conn);
+		MYSQL_ROW row = res ? mysql_fetch_row(res) : NULL;
+		if (row && row[0])
+			gtid = g_strdup(row[0]);
+		if (res)
+			mysql_free_result(res);
+	}
+	return gtid ? gtid : g_strdup("");
+}
+
+/* Snapshots can be synchronized without a global lock only when GTIDs are on and no dumped table lives outside of InnoDB */
+gboolean gtid_snapshot_possible(MYSQL *conn) {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	gboolean possible = FALSE;
+
+	if (mysql_query(conn, "SELECT @@GLOBAL.gtid_mode") || !(res = mysql_store_result(conn)))
+		return FALSE;
+	if ((row = mysql_fetch_row(res)) && row[0] && !g_ascii_strcasecmp(row[0], "ON"))
+		possible = TRUE;
+	mysql_free_result(res);
+	return possible && innodb_only(conn);
+}
+
+/* Whether every dumped table is transactional, so a consistent snapshot is all it takes to read it consistently */
+gboolean innodb_only(MYSQL *conn) {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	gboolean possible;
+
+	/* Log tables aren't covered by FTWRL either */
+	GString *query = g_string_new("SELECT COUNT(*) FROM information_schema.TABLES WHERE TABLE_TYPE='BASE TABLE' AND ENGINE<>'InnoDB'"
+		" AND TABLE_SCHEMA NOT IN ('information_schema','performance_schema','sys')"
+		" AND NOT (TABLE_SCHEMA='mysql' AND TABLE_NAME IN ('general_log','slow_log'))");
+	if (db) {
+		gchar *escaped = g_new(gchar, strlen(db)*2+1);
+		mysql_real_escape_string(conn, escaped, db, strlen(db));
+		g_string_append_printf(query, " AND TABLE_SCHEMA='%s'", escaped);
+		g_free(escaped);
+	}
+	possible = FALSE;
+	if (!mysql_query(conn, query->str) && (res = mysql_store_result(conn))) {
+		if ((row = mysql_fetch_row(res)) && row[0] && !strcmp(row[0], "0"))
+			possible = TRUE;
+		mysql_free_result(res);
+	}
+	g_string_free(query, TRUE);
+	return possible;
+}
+
+/*
+ * (Re)start the snapshot of conn, optionally reading snapshot_info inside it.
+ * With gtid returns gtid_executed read before and after, "<before> <after>" (sets never contain spaces), otherwise ""
+ */
+gchar *start_snapshot(MYSQL *conn, gboolean gtid, gchar **snapshot_info) {
+	gchar *before = gtid ? get_gtid_executed(conn) : NULL;
+
+	mysql_query(conn, "ROLLBACK");
+	if (mysql_query(conn, "START TRANSACTION /*!40108 WITH CONSISTENT SNAPSHOT */"))
+		g_critical("Failed to start consistent snapshot: %s", mysql_error(conn));
+	/* Unfortunately version before 4.1.8 did not support consistent snapshot transaction starts, so we cheat */
+	if (need_dummy_read) {
+		mysql_query(conn,"SELECT * FROM mysql.mydumperdummy");
+		MYSQL_RES *res=mysql_store_result(conn);
+		if (res)
+			mysql_free_result(res);
+	}
+	if (snapshot_info)
+		*snapshot_info = get_snapshot_info(conn);
+
+	if (!gtid)
+		return g_strdup("");
+	gchar *after = get_gtid_executed(conn);
+	gchar *sync = g_strdup_printf("%s %s", before, after);
+	g_free(before);
+	g_free(after);
+	return sync;
+}
+
+/* Have all workers start their snapshots at once, TRUE if every one reported expected */
+gboolean start_worker_snapshots(struct configuration *conf, const gchar *expected) {
+	gboolean same = TRUE;
+	guint n;
+
+	for (n=0; n<num_threads; n++)
+		g_async_queue_push(conf->start, GINT_TO_POINTER(SNAPSHOT_START));
+	for (n=0; n<num_threads; n++) {
+		gchar *sync = g_async_queue_pop(conf->ready);
+		if (strcmp(sync, expected))
+			same = FALSE;
+		g_free(sync);
+	}
+	return same;
+}
+
+/*
+ * Start consistent snapshots on conn and all connected workers, returns their binary log coordinates.
+ * FLUSH TABLES WITH READ LOCK is only held while the snapshots start in parallel. On InnoDB-only servers with GTIDs
+ * no global lock is needed: snapshots are started over until every connection saw the same gtid_executed before and
+ * after starting its snapshot, so no commit can have landed in between. lock_info tells .metadata how it went
+ */
+gchar *start_snapshots(MYSQL *conn, struct configuration *conf, gchar **lock_info) {
+	gchar *snapshot_info = NULL;
+	guint attempt;
+
+	if (lock_mode != LOCK_FTWRL && gtid_snapshot_possible(conn)) {
+		lock_mode = LOCK_GTID;
+		/* Keeps DDL out for the whole dump without blocking writes, MySQL 8.0 and later */
+		if (mysql_query(conn, "LOCK INSTANCE FOR BACKUP"))
+			g_warning("Couldn't take backup lock, DDL during the dump would go unnoticed: %s", mysql_error(conn));
+		else
+			backup_locked = 1;
+
+		for (attempt = 1; attempt <= GTID_SYNC_ATTEMPTS; attempt++) {
+			guint64 start = trace_now();
+			gchar *gtid = NULL;
+			gchar *sync = start_snapshot(conn, TRUE, NULL);
+			/* Coordinates are read once the snapshot is open, they match it if no commit came in since */
+			g_free(snapshot_info);
+			if (!(snapshot_info = get_log_status(conn, &gtid))) {
+				g_warning("Couldn't read performance_schema.log_status, binary log coordinates need FLUSH TABLES WITH READ LOCK: %s", mysql_error(conn));
+				g_free(sync);
+				break;
+			}
+			/* Main connection has to be stable itself and match the coordinates, then every worker has to match it */
+			gchar *space = strchr(sync, ' ');
+			gboolean synced = strlen(space + 1) == (gsize)(space - sync) && !strncmp(sync, space + 1, space - sync)
+				&& strlen(gtid) == (gsize)(space - sync) && !strncmp(sync, gtid, space - sync);
+			synced = start_worker_snapshots(conf, sync) && synced;
+			g_free(sync);
+			g_free(gtid);
+			trace_end("gtid snapshot", start, NULL);
+			if (synced) {
+				gchar *slave_info = get_slave_info(conn);
+				gchar *info = g_strconcat(snapshot_info, slave_info, NULL);
+				g_free(slave_info);
+				g_free(snapshot_info);
+				*lock_info = g_strdup_printf("Snapshots synchronized by GTID after %u attempt%s, no global read lock%s\n\n",
+					attempt, attempt > 1 ? "s" : "", backup_locked ? ", backup lock held" : "");
+				return info;
+			}
+		}
+		if (snapshot_info)
+			g_warning("Server too busy to synchronize snapshots by GTID, falling back to FLUSH TABLES WITH READ LOCK");
+		g_free(snapshot_info);
+	} else if (lock_mode == LOCK_GTID) {
+		g_warning("GTID synchronized snapshots need gtid_mode=ON and InnoDB-only tables, falling back to FLUSH TABLES WITH READ LOCK");
+	}
+
+	lock_mode = LOCK_FTWRL;
+	guint64 start = trace_now();
+	GTimer *timer = g_timer_new();
+	/* Without it neither the snapshots nor the binary log coordinates they are recorded with would be consistent */
+	if (mysql_query(conn, "FLUSH TABLES WITH READ LOCK")) {
+		g_critical("Couldn't acquire global lock: %s", mysql_error(conn));
+		exit(EXIT_FAILURE);
+	}
+	g_free(start_snapshot(conn, FALSE, &snapshot_info));
+	start_worker_snapshots(conf, "");
+	mysql_query(conn, "UNLOCK TABLES");
+	*lock_info = g_strdup_printf("Global read lock held: %.3f seconds\n\n", g_timer_elapsed(timer, NULL));
+	g_timer_destroy(timer);
+	trace_end("global lock", start, NULL);
+	return snapshot_info;
+}
+
+/* --replicas list, --host coming first. conn is the main connection to --host */
+void parse_replicas(MYSQL *conn) {
+	gchar **hosts = g_strsplit(replicas_list, ",", 0);
+	guint i;
+
+	replicas = g_ptr_array_new();
+	struct replica *r = g_new0(struct replica, 1);
+	r->host = hostname;
+	r->port = port;
+	r->socket = socket_path;
+	r->conn = conn;
+	g_ptr_array_add(replicas, r);
+
+	for (i = 0; hosts[i]; i++) {
+		gchar *host = g_strstrip(hosts[i]);
+		if (!host[0])
+			continue;
+		r = g_new0(struct replica, 1);
+		gchar *colon = strrchr(host, ':');
+		r->port = port;
+		if (colon) {
+			*colon = '\0';
+			r->port = strtoul(colon + 1, NULL, 10);
+		}
+		r->host = g_strdup(host);
+		r->conn = mysql_init(NULL);
+		mysql_options(r->conn, MYSQL_READ_DEFAULT_GROUP, "mydumper");
+		if (!mysql_real_connect(r->conn, r->host, username, password, db, r->port, NULL, 0)) {
+			g_critical("Error connecting to replica %s:%u: %s", r->host, r->port, mysql_error(r->conn));
+			exit(EXIT_FAILURE);
+		}
+		g_ptr_array_add(replicas, r);
+	}
+	g_strfreev(hosts);
+}
+
+/* Where the SQL thread of r is, from SHOW SLAVE STATUS and gtid_executed. FALSE if r isn't replicating */
+gboolean read_replica_position(struct replica *r, gboolean gtid, gboolean *sql_running) {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	MYSQL_FIELD *fields;
+	guint i;
+
+	if (mysql_query(r->conn, "SHOW SLAVE STATUS") || !(res = mysql_store_result(r->conn)))
+		return FALSE;
+	/* A row per channel, there is no single position to pause a multi-source replica at */
+	if (mysql_num_rows(res) > 1) {
+		g_critical("%s replicates from %llu sources, --replicas only works with single-source replicas",
+			r->host ? r->host : "localhost", (unsigned long long)mysql_num_rows(res));
+		exit(EXIT_FAILURE);
+	}
+	if (!(row = mysql_fetch_row(res))) {
+		mysql_free_result(res);
+		return FALSE;
+	}
+	g_free(r->master_host);
+	g_free(r->master_log);
+	r->master_host = r->master_log = NULL;
+	fields = mysql_fetch_fields(res);
+	for (i = 0; i < mysql_num_fields(res); i++) {
+		if (!strcasecmp("master_host", fields[i].name))
+			r->master_host = g_strdup(row[i]);
+		else if (!strcasecmp("relay_master_log_file", fields[i].name))
+			r->master_log = g_strdup(row[i]);
+		else if (!strcasecmp("exec_master_log_pos", fields[i].name))
+			r->master_pos = row[i] ? strtoull(row[i], NULL, 10) : 0;
+		else if (!strcasecmp("slave_sql_running", fields[i].name) && sql_running)
+			*sql_running = row[i] && !strcasecmp(row[i], "Yes");
+	}
+	mysql_free_result(res);
+
+	g_free(r->gtid);
+	r->gtid = gtid ? get_gtid_executed(r->conn) : NULL;
+	return r->master_log != NULL;
+}
+
+/* Whether every transaction in GTID set a is in b too */
+gboolean gtid_subset(MYSQL *conn, const gchar *a, const gchar *b) {
+	gchar *query = g_strdup_printf("SELECT GTID_SUBSET('%s', '%s')", a, b);
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	gboolean subset = FALSE;
+
+	if (!mysql_query(conn, query) && (res = mysql_store_result(conn))) {
+		if ((row = mysql_fetch_row(res)) && row[0])
+			subset = !strcmp(row[0], "1");
+		mysql_free_result(res);
+	}
+	g_free(query);
+	return subset;
+}
+
+/* Whether r has executed everything target has (and, with binary log coordinates, nothing more) */
+gboolean replica_at(MYSQL *conn, struct replica *r, struct replica *target, gboolean gtid) {
+	if (gtid)
+		return gtid_subset(conn, target->gtid, r->gtid);
+	return !strcmp(r->master_log, target->master_log) && r->master_pos == target->master_pos;
+}
+
+/*
+ * Stop the SQL thread of every replica, let the ones behind replay up to the most advanced with START SLAVE UNTIL,
+ * then start snapshots on all connections. Nothing is applied in between, so every worker sees the same data without
+ * any lock. Positions are compared by GTID where all replicas have it on, by source binary log coordinates otherwise.
+ * Replication is resumed as soon as snapshots are open, unless non-transactional tables have to be read
+ */
+gchar *sync_replicas(MYSQL *conn, struct configuration *conf, gchar **lock_info) {
+	gboolean gtid = TRUE;
+	struct replica *target = NULL;
+	guint i, j;
+	gchar *snapshot_info = NULL;
+	guint64 start = trace_now();
+	GTimer *timer = g_timer_new();
+
+	for (i = 0; i < replicas->len; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		MYSQL_RES *res;
+		MYSQL_ROW row;
+		gboolean on = FALSE;
+		if (!mysql_query(r->conn, "SELECT @@GLOBAL.gtid_mode") && (res = mysql_store_result(r->conn))) {
+			on = (row = mysql_fetch_row(res)) && row[0] && !g_ascii_strcasecmp(row[0], "ON");
+			mysql_free_result(res);
+		}
+		gtid = gtid && on;
+	}
+
+	/* Whatever way the dump ends from here, replication is not left stopped */
+	atexit(resume_replicas_at_exit);
+	for (i = 0; i < replicas->len; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		if (!read_replica_position(r, gtid, &r->sql_running)) {
+			g_critical("%s is not a replica, --replicas needs every server to replicate from the same source", r->host ? r->host : "localhost");
+			exit(EXIT_FAILURE);
+		}
+		if (mysql_query(r->conn, "STOP SLAVE SQL_THREAD")) {
+			g_critical("Couldn't pause replication on %s: %s", r->host ? r->host : "localhost", mysql_error(r->conn));
+			resume_replicas();
+			exit(EXIT_FAILURE);
+		}
+		read_replica_position(r, gtid, NULL);
+	}
+
+	/* Most advanced replica, every other one has to be behind it on the same stream */
+	for (i = 0; i < replicas->len && !target; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		for (j = 0; j < replicas->len; j++) {
+			struct replica *o = g_ptr_array_index(replicas, j);
+			if (gtid ? !gtid_subset(conn, o->gtid, r->gtid) :
+					(g_strcmp0(o->master_host, r->master_host) || strcmp(o->master_log, r->master_log) > 0 ||
+					(!strcmp(o->master_log, r->master_log) && o->master_pos > r->master_pos)))
+				break;
+		}
+		if (j == replicas->len)
+			target = r;
+	}
+	if (!target) {
+		g_critical("Replicas have diverged or replicate from different sources, they can't be paused at one position");
+		resume_replicas();
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < replicas->len; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		if (r == target || replica_at(conn, r, target, gtid))
+			continue;
+
+		gchar *until, *wait;
+		if (gtid) {
+			until = g_strdup_printf("START SLAVE SQL_THREAD UNTIL SQL_AFTER_GTIDS = '%s'", target->gtid);
+			wait = g_strdup_printf("SELECT WAIT_FOR_EXECUTED_GTID_SET('%s', %d)", target->gtid, REPLICA_SYNC_TIMEOUT);
+		} else {
+			until = g_strdup_printf("START SLAVE SQL_THREAD UNTIL MASTER_LOG_FILE = '%s', MASTER_LOG_POS = %llu",
+				target->master_log, (unsigned long long)target->master_pos);
+			wait = g_strdup_printf("SELECT MASTER_POS_WAIT('%s', %llu, %d)",
+				target->master_log, (unsigned long long)target->master_pos, REPLICA_SYNC_TIMEOUT);
+		}
+		gboolean ok = !mysql_query(r->conn, until) && !mysql_query(r->conn, wait);
+		if (ok) {
+			MYSQL_RES *res = mysql_store_result(r->conn);
+			if (res)
+				mysql_free_result(res);
+		}
+		g_free(until);
+		g_free(wait);
+		/* UNTIL stops the SQL thread by itself, this is for when the wait timed out */
+		mysql_query(r->conn, "STOP SLAVE SQL_THREAD");
+
+		read_replica_position(r, gtid, NULL);
+		if (!ok || !replica_at(conn, r, target, gtid)) {
+			g_critical("Replica %s couldn't catch up with %s: %s", r->host ? r->host : "localhost",
+				target->host ? target->host : "localhost", mysql_error(r->conn));
+			resume_replicas();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Nothing moves anymore, snapshots can start one after the other */
+	lock_mode = LOCK_REPLICAS;
+	g_free(start_snapshot(conn, FALSE, &snapshot_info));
+	start_worker_snapshots(conf, "");
+
+	GString *info = g_string_new("");
+	g_string_append_printf(info, "Replicas synchronized at %s", gtid ? "GTID set" : "source position");
+	if (gtid)
+		g_string_append_printf(info, " %s:", target->gtid);
+	else
+		g_string_append_printf(info, " %s:%llu on %s:", target->master_log, (unsigned long long)target->master_pos, target->master_host);
+	for (i = 0; i < replicas->len; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		g_string_append_printf(info, " %s:%u", r->host ? r->host : "localhost", r->port);
+	}
+	if (innodb_only(conn)) {
+		resume_replicas();
+		g_string_append_printf(info, "\nReplication paused: %.3f seconds\n\n", g_timer_elapsed(timer, NULL));
+	} else {
+		replicas_paused = 1;
+		g_string_append(info, "\nReplication paused until the end of the dump, non-transactional tables are read\n\n");
+	}
+	*lock_info = g_string_free(info, FALSE);
+
+	g_timer_destroy(timer);
+	trace_end("replica sync", start, NULL);
+	return snapshot_info;
+}
+
+/* Restart the SQL threads paused by sync_replicas() */
+void resume_replicas(void) {
+	guint i;
+
+	for (i = 0; i < replicas->len; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		if (r->sql_running && mysql_query(r->conn, "START SLAVE SQL_THREAD"))
+			g_warning("Couldn't resume replication on %s, it has to be started by hand: %s",
+				r->host ? r->host : "localhost", mysql_error(r->conn));
+		r->sql_running = FALSE;
+	}
+	replicas_paused = 0;
+}
+
+/*
+ * Last resort for every exit() while replication is paused. Control connections may be in the middle of
+ * a query in another thread, so each replica gets a connection of its own
+ */
+void resume_replicas_at_exit(void) {
+	guint i;
+
+	for (i = 0; replicas && i < replicas->len; i++) {
+		struct replica *r = g_ptr_array_index(replicas, i);
+		if (!r->sql_running)
+			continue;
+		r->sql_running = FALSE;
+
+		MYSQL *conn = mysql_init(NULL);
+		mysql_options(conn, MYSQL_READ_DEFAULT_GROUP, "mydumper");
+		if (!mysql_real_connect(conn, r->host, username, password, NULL, r->port, r->socket, 0)
+				|| mysql_query(conn, "START SLAVE SQL_THREAD"))
+			g_critical("Couldn't resume replication on %s, it has to be started by hand: %s",
+				r->host ? r->host : "localhost", mysql_error(conn));
+		else
+			g_message("Resumed replication on %s", r->host ? r->host : "localhost");
+		mysql_close(conn);
+	}
+}
+
+static gpointer signal_thread(gpointer data) {
+	sigset_t *set = data;
+	int sig;
+
+	sigwait(set, &sig);
+	g_critical("Interrupted by signal %d", sig);
+	/* Runs resume_replicas_at_exit() */
+	exit(EXIT_FAILURE);
+	return NULL;
+}
+
+/* SIGINT, SIGTERM and SIGHUP go to a thread of their own that exits cleanly, threads started later inherit the mask */
+void catch_signals(void) {
+	static sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	g_thread_create(signal_thread, &set, FALSE, NULL);
 }
 
 void *process_queue(struct configuration * conf) {
+	guint64 start = trace_now();
+	char *host = hostname, *sock = socket_path;
+	guint hport = port;
 	mysql_thread_init();
 	MYSQL *thrconn = mysql_init(NULL);
 	mysql_options(thrconn,MYSQL_READ_DEFAULT_GROUP,"mydumper");
 
-	if(!mysql_real_connect(thrconn, hostname, username, password, db, port, socket_path, 0)) {
+	/* With --replicas threads are spread evenly over all servers */
+	if (replicas) {
+		struct replica *r = g_ptr_array_index(replicas, g_atomic_int_exchange_and_add(&next_replica, 1) % replicas->len);
+		host = r->host;
+		hport = r->port;
+		sock = r->socket;
+	}
+	if(!mysql_real_connect(thrconn, host, username, password, db, hport, sock, 0)) {
 		g_critical("Failed to connect to database: %s", mysql_error(thrconn));
 		exit(EXIT_FAILURE);
 	}
 	if (mysql_query(thrconn, "SET SESSION wait_timeout = 2147483")){
 		g_warning("Failed to increase wait_timeout: %s", mysql_error(thrconn));
         }
-
-	if (mysql_query(thrconn, "START TRANSACTION /*!40108 WITH CONSISTENT SNAPSHOT */")) {
-		g_critical("Failed to start consistent snapshot: %s",mysql_error(thrconn));
-	}
-	/* Unfortunately version before 4.1.8 did not support consistent snapshot transaction starts, so we cheat */
-	if (need_dummy_read) {
-		mysql_query(thrconn,"SELECT * FROM mysql.mydumperdummy");
-		MYSQL_RES *res=mysql_store_result(thrconn);
-		if (res)
-			mysql_free_result(res);
-	}
 	mysql_query(thrconn, "/*!40101 SET NAMES binary*/");
 
+	struct pipeline *pl = pipeline_new(thrconn);
+	if (clone_output)
+		pl->target = connect_target();
+	trace_thread("worker %u", pl->stats->id);
+	trace_end("connect", start, host);
+
 	g_async_queue_push(conf->ready,GINT_TO_POINTER(1));
 
+	/* Connected before any lock is taken, snapshots start on request, all workers at once */
+	while (GPOINTER_TO_INT(g_async_queue_pop(conf->start)) == SNAPSHOT_START) {
+		start = trace_now();
+		g_async_queue_push(conf->ready, start_snapshot(thrconn, lock_mode == LOCK_GTID, NULL));
+		trace_end("snapshot", start, NULL);
+	}
+
 	struct job* job;
 	for(;;) {
 		GTimeVal tv;
 		g_get_current_time(&tv);
 		g_time_val_add(&tv,1000*1000*1);
+		start = trace_now();
 		job=(struct job *)g_async_queue_pop(conf->queue);
+		trace_end("queue wait", start, NULL);
 		switch (job->type) {
 			case JOB_DUMP:
-				dump_table_data_file(thrconn, job->database, job->table, job->where, job->filename);
+				dump_table_data_file(thrconn, pl, job);
 				break;
 			case JOB_SHUTDOWN:
+				/* Queue is drained, keep the tail parallel by splitting whatever others are still chewing on */
+				g_mutex_lock(conf->mutex);
+				conf->idle++;
+				g_mutex_unlock(conf->mutex);
+				for (;;) {
+					struct job *stolen = steal_job(conf);
+					if (!stolen)
+						break;
+					dump_table_data_file(thrconn, pl, stolen);
+					free_job(stolen);
+				}
+				g_mutex_lock(conf->mutex);
+				conf->idle--;
+				g_mutex_unlock(conf->mutex);
+				pipeline_free(pl);
 				if (thrconn)
 					mysql_close(thrconn);
 				g_free(job);
@@ -222,18 +1107,88 @@ void *process_queue(struct configuration * conf) {
 				return NULL;
 				break;
 		}
-		if(job->database) g_free(job->database);
-		if(job->table) g_free(job->table);
-		if(job->where) g_free(job->where);
-		if(job->filename) g_free(job->filename);
-		g_free(job);
+		free_job(job);
 	}
 	return NULL;
 }
 
+void free_job(struct job *job) {
+	if(job->database) g_free(job->database);
+	if(job->table) g_free(job->table);
+	g_free(job->partition);
+	if(job->where) g_free(job->where);
+	if(job->filename) g_free(job->filename);
+	g_free(job->checksum_columns);
+	g_free(job->checksum);
+	if(job->range) {
+		g_free(job->range->field);
+		g_free(job->range);
+	}
+	g_free(job);
+}
+
+/* Next file name for a piece stolen from job: db.table.00003.sql becomes db.table.00003-1.sql */
+gchar *stolen_filename(struct job *job) {
+	gchar *ext = g_strrstr(job->filename, ".sql");
+	gchar *base = g_strndup(job->filename, ext - job->filename);
+	gchar *filename = g_strdup_printf("%s-%u%s", base, job->range->stolen_before + job->range->steals, ext);
+	g_free(base);
+	return filename;
+}
+
+/*
+ * Split the running range job with most unclaimed keys in half and return the upper half as new job,
+ * NULL when nothing is worth splitting
+ */
+struct job *steal_job(struct configuration *conf) {
+	struct job *victim = NULL, *j = NULL;
+	guint64 remaining = 0;
+	GList *l;
+
+	g_mutex_lock(conf->mutex);
+	for (l = conf->running; l; l = l->next) {
+		struct job *candidate = (struct job *)l->data;
+		struct chunk_range *range = candidate->range;
+		if (range->upper > range->cursor && range->upper - range->cursor > remaining) {
+			victim = candidate;
+			remaining = range->upper - range->cursor;
+		}
+	}
+
+	/* Both halves should still be at least a slice */
+	if (victim && remaining >= 2*victim->range->slice) {
+		struct chunk_range *range = victim->range;
+		guint64 middle = range->cursor + remaining/2;
+
+		j = g_new0(struct job, 1);
+		j->type = JOB_DUMP;
+		j->database = g_strdup(victim->database);
+		j->table = g_strdup(victim->table);
+		j->partition = g_strdup(victim->partition);
+		j->conf = conf;
+		range->steals++;
+		j->filename = stolen_filename(victim);
+		j->range = g_new0(struct chunk_range, 1);
+		j->range->field = g_strdup(range->field);
+		j->range->lower = middle;
+		j->range->cursor = middle;
+		j->range->upper = range->upper;
+		j->range->slice = range->slice;
+		range->upper = middle;
+
+		/* Both halves are recorded before the new file exists */
+		manifest_planned(victim);
+		manifest_planned(j);
+		manifest_sync();
+	}
+	g_mutex_unlock(conf->mutex);
+
+	return j;
+}
+
 int main(int argc, char *argv[])
 {
-	struct configuration conf = { 1, NULL, NULL, NULL, 0 };
+	struct configuration conf = { 1, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0 };
 
 	GError *error = NULL;
 	GOptionContext *context;
@@ -249,31 +1204,114 @@ int main(int argc, char *argv[])
 	}
 	g_option_context_free(context);
 
-	time_t t;
-	time(&t);localtime_r(&t,&tval);
+	/* Every instance dump goes on from here in a process of its own */
+	if (instances_file)
+		run_instances();
 
-	if (!directory)
-		directory = g_strdup_printf("%s-%04d%02d%02d-%02d%02d%02d",DIRECTORY,
-			tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
-			tval.tm_hour, tval.tm_min, tval.tm_sec);
+	/* Paused replicas have to be resumed on interrupts too, before any other thread exists */
+	if (replicas_list)
+		catch_signals();
 
-	create_backup_dir(directory);
+	trace_init(trace_file);
+	trace_thread("main");
 
-	char *p;
-	FILE* mdfile=g_fopen(p=g_strdup_printf("%s/.metadata",directory),"w");
-	g_free(p);
-	if(!mdfile) {
-		g_critical("Couldn't write metadata file (%d)",errno);
-		exit(1);
+	if (compress_codec)
+		compress_output = 1;
+	if (compress_output) {
+		output_codec = codec_from_name(compress_codec);
+		compress_init(compress_threads ? compress_threads : num_threads);
 	}
-
-	/* Give ourselves an array of engines to ignore */
-	if (ignore_engines)
-		ignore = g_strsplit(ignore_engines, ",", 0);
-
-	/* Give ourselves an array of tables to dump */
+	if (stream_output) {
+		if (resume || differential_from) {
+			g_critical("--stream can't be combined with --resume or --differential, both need the files of a dump");
+			exit(EXIT_FAILURE);
+		}
+		/* Nothing but frames may go to standard output from here on */
+		output_set_stream(fileno(stdout));
+	}
+	memory_init((guint64)memory_limit*1024*1024);
+	output_set_direct_io(direct_io);
+	/* Chunks are only marked done in the manifest once they are on disk */
+	output_set_sync(!stream_output);
+
+	if (!lock_mode_name || !g_ascii_strcasecmp(lock_mode_name, "auto")) {
+		lock_mode = LOCK_AUTO;
+	} else if (!g_ascii_strcasecmp(lock_mode_name, "ftwrl")) {
+		lock_mode = LOCK_FTWRL;
+	} else if (!g_ascii_strcasecmp(lock_mode_name, "gtid")) {
+		lock_mode = LOCK_GTID;
+	} else {
+		g_critical("Unknown --lock-mode %s, use auto, ftwrl or gtid", lock_mode_name);
+		exit(EXIT_FAILURE);
+	}
+
+	clone_output = target_host || target_socket;
+	if (clone_output && (stream_output || resume || incremental_from || differential_from)) {
+		g_critical("Cloning into --target-host can't be combined with --stream, --resume, --incremental or --differential");
+		exit(EXIT_FAILURE);
+	}
+
+	if (replicas_list && lock_mode_name) {
+		g_critical("--replicas pauses replication to synchronize snapshots, --lock-mode doesn't apply");
+		exit(EXIT_FAILURE);
+	}
+
+	if (resume && !directory) {
+		g_critical("--resume needs --outputdir of the dump to resume");
+		exit(EXIT_FAILURE);
+	}
+	if (resume && incremental_from) {
+		g_critical("--resume and --incremental can't be combined, an incremental dump is simply taken again");
+		exit(EXIT_FAILURE);
+	}
+
+	time_t t;
+	time(&t);localtime_r(&t,&tval);
+
+	if (!directory)
+		directory = g_strdup_printf("%s-%04d%02d%02d-%02d%02d%02d",DIRECTORY,
+			tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
+			tval.tm_hour, tval.tm_min, tval.tm_sec);
+
+	if (!stream_output)
+		create_backup_dir(directory);
+
+	char *p = NULL;
+	gchar *old_metadata = NULL;
+	if (resume) {
+		p = g_strdup_printf("%s/.metadata",directory);
+		if (!g_file_get_contents(p, &old_metadata, NULL, NULL)) {
+			g_critical("Couldn't read metadata file %s, nothing to resume", p);
+			exit(EXIT_FAILURE);
+		}
+		g_free(p);
+	}
+	FILE* mdfile;
+	if (stream_output)
+		mdfile=open_memstream(&metadata_buffer, &metadata_size);
+	else {
+		mdfile=g_fopen(p=g_strdup_printf("%s/.metadata",directory),resume?"a":"w");
+		g_free(p);
+	}
+	if(!mdfile) {
+		g_critical("Couldn't write metadata file (%d)",errno);
+		exit(1);
+	}
+	if (!incremental_from && !stream_output && !clone_output)
+		manifest_open(resume);
+
+	if (differential_from && !(previous_chunks = read_manifest(differential_from, NULL))) {
+		g_critical("Couldn't read manifest of previous dump in %s", differential_from);
+		exit(EXIT_FAILURE);
+	}
+	if (previous_chunks)
+		previous_tables = index_previous_chunks(previous_chunks);
+
+	/* Give ourselves sets of engines to ignore and tables to dump */
+	if (ignore_engines)
+		ignore = name_set(ignore_engines);
 	if (tables_list)
-		tables = g_strsplit(tables_list, ",", 0);
+		tables = name_set(tables_list);
 
 	MYSQL *conn;
 	conn = mysql_init(NULL);
@@ -289,6 +1327,30 @@ int main(int argc, char *argv[])
 	if (mysql_query(conn, "SET SESSION net_write_timeout = 2147483")){
 		g_warning("Failed to increase net_write_timeout: %s", mysql_error(conn));
 	}
+	if (clone_output)
+		target_conn = connect_target();
+
+	/* Changes come from the binary log, no locks or snapshots needed */
+	if (incremental_from) {
+		int ret = dump_incremental(conn, mdfile);
+		compress_end();
+
+		time(&t);localtime_r(&t,&tval);
+		fprintf(mdfile,"Finished dump at: %04d-%02d-%02d %02d:%02d:%02d\n",
+			tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
+			tval.tm_hour, tval.tm_min, tval.tm_sec);
+		close_metadata(mdfile);
+
+		mysql_close(conn);
+		mysql_thread_end();
+		mysql_library_end();
+		g_free(directory);
+		if (ignore)
+			g_hash_table_destroy(ignore);
+		if (tables)
+			g_hash_table_destroy(tables);
+		return ret ? EXIT_FAILURE : 0;
+	}
 
 	/*
 	 * We check SHOW PROCESSLIST, and if there're queries
@@ -333,59 +1395,73 @@ int main(int argc, char *argv[])
 		mysql_free_result(res);
 	}
 
-	if (mysql_query(conn, "FLUSH TABLES WITH READ LOCK"))
-		g_warning("Couldn't acquire global lock, snapshots will not be consistent: %s",mysql_error(conn));
+	conf.queue = g_async_queue_new();
+	conf.ready = g_async_queue_new();
+	conf.start = g_async_queue_new();
+	conf.mutex = g_mutex_new();
+	stats_start(stats_file, stats_interval, conf.queue);
 
+	/* Servers before 4.1.8 can't start consistent snapshots, the table is created before any lock is taken */
 	if (mysql_get_server_version(conn)) {
 		mysql_query(conn, "CREATE TABLE IF NOT EXISTS mysql.mydumperdummy (a INT) ENGINE=INNODB");
 		need_dummy_read=1;
 	}
-	mysql_query(conn, "START TRANSACTION /*!40108 WITH CONSISTENT SNAPSHOT */");
-	if (need_dummy_read) {
-		mysql_query(conn,"SELECT * FROM mysql.mydumperdummy");
-		MYSQL_RES *res=mysql_store_result(conn);
-		if (res)
-			mysql_free_result(res);
-	}
-
-	time(&t);localtime_r(&t,&tval);
-	fprintf(mdfile,"Started dump at: %04d-%02d-%02d %02d:%02d:%02d\n",
-		tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday, 
-		tval.tm_hour, tval.tm_min, tval.tm_sec);
-
-	mysql_query(conn, "/*!40101 SET NAMES binary*/");
 
-	write_snapshot_info(conn, mdfile);
-
-	conf.queue = g_async_queue_new();
-	conf.ready = g_async_queue_new();
+	if (replicas_list)
+		parse_replicas(conn);
 
+	/* Workers connect in parallel and outside of the lock */
 	guint n;
 	GThread **threads = g_new(GThread*,num_threads);
-	for (n=0; n<num_threads; n++) {
+	for (n=0; n<num_threads; n++)
 		threads[n] = g_thread_create((GThreadFunc)process_queue,&conf,TRUE,NULL);
+	for (n=0; n<num_threads; n++)
 		g_async_queue_pop(conf.ready);
-	}
+
+	gchar *lock_info = NULL;
+	gchar *snapshot_info = replicas ? sync_replicas(conn, &conf, &lock_info) : start_snapshots(conn, &conf, &lock_info);
+	for (n=0; n<num_threads; n++)
+		g_async_queue_push(conf.start, GINT_TO_POINTER(SNAPSHOT_DONE));
+	g_async_queue_unref(conf.start);
 	g_async_queue_unref(conf.ready);
-	mysql_query(conn, "UNLOCK TABLES");
 
-	if (db) {
-		dump_database(conn, db, &conf);
-	} else {
-		MYSQL_RES *databases;
-		MYSQL_ROW row;
-		if(mysql_query(conn,"SHOW DATABASES")) {
-			g_critical("Unable to list databases: %s",mysql_error(conn));
-		}
-		databases = mysql_store_result(conn);
-		while ((row=mysql_fetch_row(databases))) {
-			if (!strcmp(row[0],"information_schema"))
-				continue;
-			dump_database(conn, row[0], &conf);
+	/* Resumed chunks have to come from the very same data the finished ones were read from */
+	if (resume) {
+		if (!snapshot_info[0]) {
+			g_warning("No binary log coordinates available, cannot verify the server did not change since the original dump");
+		} else if (!strstr(old_metadata, snapshot_info)) {
+			g_critical("Server is no longer at the binary log position of the original dump, resumed dump would not be consistent");
+			exit(EXIT_FAILURE);
 		}
-		mysql_free_result(databases);
 	}
 
+	time(&t);localtime_r(&t,&tval);
+	fprintf(mdfile,"%s dump at: %04d-%02d-%02d %02d:%02d:%02d\n",
+		resume ? "Resumed" : "Started",
+		tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday, 
+		tval.tm_hour, tval.tm_min, tval.tm_sec);
+
+	mysql_query(conn, "/*!40101 SET NAMES binary*/");
+
+	if (!resume)
+		fputs(snapshot_info, mdfile);
+	fputs(lock_info, mdfile);
+	fflush(mdfile);
+	g_free(snapshot_info);
+	g_free(lock_info);
+	g_free(old_metadata);
+
+	guint64 discovery_start = trace_now();
+	conf.pending = g_tree_new(job_size_compare);
+	if (resume)
+		resume_jobs(&conf);
+	else
+		dump_catalog(conn, &conf);
+	release_jobs(&conf, 0);
+	manifest_complete();
+	g_tree_destroy(conf.pending);
+	trace_end("discovery", discovery_start, NULL);
+
 	for (n=0; n<num_threads; n++) {
 		struct job *j = g_new0(struct job,1);
 		j->type = JOB_SHUTDOWN;
@@ -395,35 +1471,325 @@ int main(int argc, char *argv[])
 	for (n=0; n<num_threads; n++) {
 		g_thread_join(threads[n]);
 	}
+	stats_stop();
+	trace_write();
 	g_async_queue_unref(conf.queue);
+	g_mutex_free(conf.mutex);
+	compress_end();
+	manifest_close();
+	if (previous_tables)
+		g_hash_table_destroy(previous_tables);
+	if (previous_chunks)
+		g_hash_table_destroy(previous_chunks);
+
+	if (backup_locked)
+		mysql_query(conn, "UNLOCK INSTANCE");
+	if (target_conn)
+		mysql_close(target_conn);
+	if (replicas) {
+		if (replicas_paused)
+			resume_replicas();
+		for (n=0; n<replicas->len; n++) {
+			struct replica *r = g_ptr_array_index(replicas, n);
+			/* The first one is --host, on the main connection */
+			if (n) {
+				mysql_close(r->conn);
+				g_free(r->host);
+			}
+			g_free(r->gtid);
+			g_free(r->master_host);
+			g_free(r->master_log);
+			g_free(r);
+		}
+		g_ptr_array_free(replicas, TRUE);
+	}
 
 	time(&t);localtime_r(&t,&tval);
 	fprintf(mdfile,"Finished dump at: %04d-%02d-%02d %02d:%02d:%02d\n",
 		tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
 		tval.tm_hour, tval.tm_min, tval.tm_sec);
-	fclose(mdfile);
+	close_metadata(mdfile);
 
 	mysql_close(conn);
 	mysql_thread_end();
 	mysql_library_end();
 	g_free(directory);
 	g_free(threads);
-	g_strfreev(ignore);
-	g_strfreev(tables);
+	if (ignore)
+		g_hash_table_destroy(ignore);
+	if (tables)
+		g_hash_table_destroy(tables);
+	if (failed_jobs) {
+		g_critical("%d chunks could not be dumped", failed_jobs);
+		return EXIT_FAILURE;
+	}
 	return (0);
 }
 
+/* In --stream mode .metadata goes out as the last file, once everything it describes is in the stream */
+void close_metadata(FILE *mdfile) {
+	fclose(mdfile);
+	if (!stream_output)
+		return;
+
+	gchar *p = g_strdup_printf("%s/.metadata", directory);
+	struct output_file *file = output_open(p, CODEC_NONE);
+	if (!file || output_write(file, metadata_buffer, metadata_size) < 0 || output_close(file))
+		g_critical("Couldn't write metadata to the stream (%d)", errno);
+	g_free(p);
+	free(metadata_buffer);
+}
+
+/* Master binlog coordinates recorded in .metadata of a previous (full or incremental) dump */
+gboolean read_master_status(const char *dir, char **file, guint64 *pos) {
+	gchar *p = g_strdup_printf("%s/.metadata", dir);
+	gchar *contents = NULL, *status;
+	gboolean found = FALSE;
+
+	if (g_file_get_contents(p, &contents, NULL, NULL) && (status = strstr(contents, "SHOW MASTER STATUS:\n\tLog: "))) {
+		gchar **lines = g_strsplit(status, "\n", 4);
+		if (g_strv_length(lines) >= 3 && g_str_has_prefix(lines[2], "\tPos: ")) {
+			*file = g_strdup(lines[1] + strlen("\tLog: "));
+			*pos = strtoull(lines[2] + strlen("\tPos: "), NULL, 10);
+			found = TRUE;
+		}
+		g_strfreev(lines);
+	}
+	g_free(contents);
+	g_free(p);
+	return found;
+}
+
+/* Same database, --tables-list and --regex selection as a full dump, engines are not known from the binary log */
+gboolean incremental_filter(char *database, char *table) {
+	if (!table)
+		return db ? !strcmp(database, db) : strcmp(database, "information_schema") != 0;
+	return table_selected(database, table, NULL);
+}
+
+/*
+ * Incremental dump: rows changed between the snapshot of a previous dump and now, as per-table
+ * delta files that myloader replays on top of it. Coordinates reached are recorded like a full
+ * dump records its snapshot, so incremental dumps chain
+ */
+int dump_incremental(MYSQL *conn, FILE *mdfile) {
+	char *start_file = NULL, *stop_file = NULL;
+	guint64 start_pos = 0, stop_pos = 0;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	if (!read_master_status(incremental_from, &start_file, &start_pos)) {
+		g_critical("No master binary log position in %s/.metadata, can't dump changes since that dump", incremental_from);
+		return -1;
+	}
+
+	if (mysql_query(conn, "SHOW MASTER STATUS") || !(res = mysql_store_result(conn))) {
+		g_critical("Couldn't read binary log position: %s", mysql_error(conn));
+		g_free(start_file);
+		return -1;
+	}
+	if ((row = mysql_fetch_row(res))) {
+		stop_file = g_strdup(row[0]);
+		stop_pos = strtoull(row[1], NULL, 10);
+	}
+	mysql_free_result(res);
+	if (!stop_file) {
+		g_critical("Binary logging is not enabled, incremental dumps are not possible");
+		g_free(start_file);
+		return -1;
+	}
+
+	/* Replication protocol takes over the whole connection */
+	MYSQL *stream = mysql_init(NULL);
+	mysql_options(stream,MYSQL_READ_DEFAULT_GROUP,"mydumper");
+	if (!mysql_real_connect(stream, hostname, username, password, NULL, port, socket_path, 0)) {
+		g_critical("Error connecting to database: %s", mysql_error(stream));
+		g_free(start_file);
+		g_free(stop_file);
+		return -1;
+	}
+
+	time_t t;
+	time(&t);localtime_r(&t,&tval);
+	fprintf(mdfile,"Started dump at: %04d-%02d-%02d %02d:%02d:%02d\n",
+		tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
+		tval.tm_hour, tval.tm_min, tval.tm_sec);
+	fprintf(mdfile, "Incremental from:\n\tLog: %s\n\tPos: %llu\n\n", start_file, (unsigned long long)start_pos);
+	fflush(mdfile);
+
+	g_message("Dumping changes from %s:%llu to %s:%llu", start_file, (unsigned long long)start_pos,
+		stop_file, (unsigned long long)stop_pos);
+	int written = binlog_dump(conn, stream, start_file, start_pos, stop_file, stop_pos, incremental_filter, directory, output_codec);
+
+	/* Only a complete incremental dump can be the base of the next one */
+	if (written >= 0)
+		fprintf(mdfile, "SHOW MASTER STATUS:\n\tLog: %s\n\tPos: %llu\n\n", stop_file, (unsigned long long)stop_pos);
+
+	mysql_close(stream);
+	g_free(start_file);
+	g_free(stop_file);
+	return written < 0 ? -1 : 0;
+}
+
+/* Value from a result row as SQL literal suitable for WHERE clauses */
+gchar *sql_literal(MYSQL *conn, MYSQL_FIELD *field, const char *value, gulong length) {
+	GString *literal = g_string_sized_new(length*2+3);
+
+	if (get_field_formatter(field) == format_numeric) {
+		g_string_append_len(literal, value, length);
+	} else if (get_field_formatter(field) == format_hex) {
+		format_hex(literal, value, length);
+	} else {
+		g_string_set_size(literal, length*2+2);
+		literal->str[0] = '\'';
+		g_string_set_size(literal, mysql_real_escape_string(conn, literal->str+1, value, length)+1);
+		g_string_append_c(literal, '\'');
+	}
+	return g_string_free(literal, FALSE);
+}
+
+/*
+ * Tuple comparison (a,b,c) <op> (x,y,z), written out as
+ *   a <op> x OR (a = x AND b <op> y) OR (a = x AND b = y AND c <last_op> z)
+ * as older servers can't use an index range for row constructor comparisons
+ */
+void append_tuple_compare(GString *where, GPtrArray *columns, gchar **values, const char *op, const char *last_op) {
+	guint i, j;
+
+	g_string_append_c(where, '(');
+	for (i = 0; i < columns->len; i++) {
+		if (i)
+			g_string_append(where, " OR ");
+		g_string_append_c(where, '(');
+		for (j = 0; j < i; j++)
+			g_string_append_printf(where, "`%s` = %s AND ", (char *)g_ptr_array_index(columns, j), values[j]);
+		g_string_append_printf(where, "`%s` %s %s)", (char *)g_ptr_array_index(columns, i), (i == columns->len-1) ? last_op : op, values[i]);
+	}
+	g_string_append_c(where, ')');
+}
+
+/*
+ * Next chunk boundary: the index tuple rows_per_file rows after prev (or after the start when prev is NULL).
+ * Returns NULL-terminated array of literals, NULL when the end of the index is reached
+ */
+gchar **get_next_boundary(MYSQL *conn, char *database, char *table, char *partition, char *index, GPtrArray *columns, gchar **prev, gboolean strict) {
+	GString *query = g_string_new("SELECT ");
+	gchar **boundary = NULL;
+	gchar *source = table_source(database, table, partition);
+	guint i;
+
+	for (i = 0; i < columns->len; i++)
+		g_string_append_printf(query, "%s`%s`", i ? "," : "", (char *)g_ptr_array_index(columns, i));
+	g_string_append_printf(query, " FROM %s FORCE INDEX (`%s`) WHERE ", source, index);
+	g_free(source);
+	/* NULLs are left to the first chunk, boundaries only come from real values */
+	for (i = 0; i < columns->len; i++)
+		g_string_append_printf(query, "`%s` IS NOT NULL AND ", (char *)g_ptr_array_index(columns, i));
+	if (prev)
+		append_tuple_compare(query, columns, prev, ">", strict ? ">" : ">=");
+	else
+		g_string_append(query, "1");
+	g_string_append(query, " ORDER BY ");
+	for (i = 0; i < columns->len; i++)
+		g_string_append_printf(query, "%s`%s`", i ? "," : "", (char *)g_ptr_array_index(columns, i));
+	g_string_append_printf(query, " LIMIT 1 OFFSET %u", strict ? 0 : rows_per_file);
+
+	if (mysql_query(conn, query->str)) {
+		g_warning("Unable to find chunk boundaries for %s.%s: %s", database, table, mysql_error(conn));
+		g_string_free(query, TRUE);
+		return NULL;
+	}
+	g_string_free(query, TRUE);
+
+	MYSQL_RES *result = mysql_store_result(conn);
+	MYSQL_ROW row = result ? mysql_fetch_row(result) : NULL;
+	if (row) {
+		MYSQL_FIELD *fields = mysql_fetch_fields(result);
+		gulong *lengths = mysql_fetch_lengths(result);
+		boundary = g_new0(gchar *, columns->len+1);
+		for (i = 0; i < columns->len; i++)
+			boundary[i] = sql_literal(conn, &fields[i], row[i], lengths[i]);
+	}
+	if (result)
+		mysql_free_result(result);
+
+	return boundary;
+}
+
+/*
+ * Chunks for keys we can't do arithmetic on (strings, UUIDs, dates, decimals, composite keys):
+ * walk the index in rows_per_file steps and cut ranges at the tuples found
+ */
+GList * get_chunks_by_boundaries(MYSQL *conn, char *database, char *table, char *partition, char *index, GPtrArray *columns) {
+	GList *chunks = NULL;
+	GPtrArray *boundaries = g_ptr_array_new();
+	gchar **boundary = NULL;
+	guint i, b;
+
+	while ((boundary = get_next_boundary(conn, database, table, partition, index, columns, boundary, FALSE))) {
+		/* Lots of duplicates in a non-unique index, step over them */
+		if (boundaries->len) {
+			gchar **prev = g_ptr_array_index(boundaries, boundaries->len-1);
+			gchar *a = g_strjoinv(",", prev), *c = g_strjoinv(",", boundary);
+			gboolean same = !strcmp(a, c);
+			g_free(a);
+			g_free(c);
+			if (same) {
+				g_strfreev(boundary);
+				boundary = get_next_boundary(conn, database, table, partition, index, columns, prev, TRUE);
+				if (!boundary)
+					break;
+			}
+		}
+		g_ptr_array_add(boundaries, boundary);
+	}
+
+	if (!boundaries->len)
+		goto cleanup;
+
+	for (b = 0; b <= boundaries->len; b++) {
+		GString *where = g_string_new("(");
+		if (b == 0) {
+			for (i = 0; i < columns->len; i++)
+				g_string_append_printf(where, "`%s` IS NULL OR ", (char *)g_ptr_array_index(columns, i));
+		} else {
+			/*
+			 * Rows with a NULL are all in the first chunk. A NULL leading column never compares true,
+			 * one further down still does through the leading column alone, e.g. a > x for (a, NULL)
+			 */
+			for (i = 1; i < columns->len; i++)
+				g_string_append_printf(where, "`%s` IS NOT NULL AND ", (char *)g_ptr_array_index(columns, i));
+			append_tuple_compare(where, columns, g_ptr_array_index(boundaries, b-1), ">", ">=");
+		}
+		if (b > 0 && b < boundaries->len)
+			g_string_append(where, " AND ");
+		if (b < boundaries->len)
+			append_tuple_compare(where, columns, g_ptr_array_index(boundaries, b), "<", "<");
+		g_string_append_c(where, ')');
+		struct chunk *c = g_new0(struct chunk, 1);
+		c->where = g_string_free(where, FALSE);
+		chunks = g_list_append(chunks, c);
+	}
+
+cleanup:
+	for (b = 0; b < boundaries->len; b++)
+		g_strfreev(g_ptr_array_index(boundaries, b));
+	g_ptr_array_free(boundaries, TRUE);
+	return chunks;
+}
+
 /*
  * Heuristic chunks building - based on estimates, produces list of ranges for datadumping
- * WORK IN PROGRESS
+ * within partition when given. WORK IN PROGRESS
  */
-GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct configuration *conf)
+GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, char *partition, struct configuration *conf)
 {
 	GList *chunks = NULL;
 	MYSQL_RES *indexes=NULL, *minmax=NULL, *total=NULL;
 	MYSQL_ROW row;
 	char *index = NULL, *field = NULL;
-	int showed_nulls=0;
+	GPtrArray *columns = NULL;
+	guint64 start = trace_now();
 	
 	/* first have to pick index, in future should be able to preset in configuration too */
 	gchar *query = g_strdup_printf("SHOW INDEX FROM `%s`.`%s`",database,table);
@@ -465,6 +1831,7 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 					cardinality = strtoll(row[6],NULL,10);
 				if (cardinality>max_cardinality) {
 					field=row[4];
+					index=row[2];
 					max_cardinality=cardinality;
 				}
 			}
@@ -473,9 +1840,19 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 	/* Oh well, no chunks today - no suitable index */
 	if (!field) goto cleanup;
 
+	/* All columns of the chosen index, in index order */
+	columns = g_ptr_array_new();
+	mysql_data_seek(indexes,0);
+	while ((row=mysql_fetch_row(indexes))) {
+		if (!strcmp(row[2],index))
+			g_ptr_array_add(columns,row[4]);
+	}
+
 	/* Get minimum/maximum */
-	mysql_query(conn,query=g_strdup_printf("SELECT MIN(`%s`),MAX(`%s`) FROM `%s`.`%s`", field, field, database, table));
+	gchar *source = table_source(database, table, partition);
+	mysql_query(conn,query=g_strdup_printf("SELECT MIN(`%s`),MAX(`%s`) FROM %s", field, field, source));
 	g_free(query);
+	g_free(source);
 	minmax=mysql_store_result(conn);
 	
 	if (!minmax)
@@ -487,39 +1864,28 @@ GList * get_chunks_for_table(MYSQL *conn, char *database, char *table, struct co
 	char *max=row[1];
 
 	/* Got total number of rows, skip chunk logic if estimates are low */
-	guint64 rows = estimate_count(conn, database, table, field, NULL, NULL);
+	guint64 rows = estimate_count(conn, database, table, partition, field, NULL, NULL);
 	if (rows <= rows_per_file)
 		goto cleanup;
 
-	/* This is estimate, not to use as guarantee! Every chunk would have eventual adjustments */
-	guint64 estimated_chunks = rows / rows_per_file;
-	guint64 estimated_step, nmin, nmax, cutoff;
-
-	/* Support just bigger INTs for now, very dumb, no verify approach */
+	/* Bigger INTs get arithmetic ranges on the first index column, everything else walks the index */
 	switch (fields[0].type) {
 		case MYSQL_TYPE_LONG:
 		case MYSQL_TYPE_LONGLONG:
 		case MYSQL_TYPE_INT24:
-			/* static stepping */
-			nmin = strtoll(min,NULL,10);
-			nmax = strtoll(max,NULL,10);
-			estimated_step = (nmax-nmin)/estimated_chunks+1;
-			cutoff = nmin;
-			while(cutoff<=nmax) {
-				chunks=g_list_append(chunks,g_strdup_printf("%s%s(`%s` >= %llu AND `%s` < %llu)",
-						!showed_nulls?field:"",
-						!showed_nulls?" IS NULL OR ":"",
-						field, (unsigned long long)cutoff,
-						field, (unsigned long long)cutoff+estimated_step));
-				cutoff+=estimated_step;
-				showed_nulls=1;
-			}
+			if (!min || !max)
+				goto cleanup;
+			chunks = get_range_chunks(conn, database, table, partition, field, strtoll(min,NULL,10), strtoll(max,NULL,10), rows, TRUE);
+			goto cleanup;
 
 		default:
+			chunks = get_chunks_by_boundaries(conn, database, table, partition, index, columns);
 			goto cleanup;
 	}
 
 cleanup:	
+	if (columns)
+		g_ptr_array_free(columns, TRUE);
 	if (indexes) 
 		mysql_free_result(indexes);
 	if (minmax)
@@ -527,17 +1893,95 @@ cleanup:
 	if (total)
 		mysql_free_result(total);
 
+	trace_end("plan chunks", start, partition ? partition : table);
+	return chunks;
+}
+
+/*
+ * Integer ranges over cutoff..nmax holding about rows_per_file rows each, rows is the estimate for all of it.
+ * The first one also takes NULLs when nulls is set
+ */
+GList *get_range_chunks(MYSQL *conn, char *database, char *table, char *partition, char *field, guint64 cutoff, guint64 nmax, guint64 rows, gboolean nulls) {
+	GList *chunks = NULL;
+	/* This is estimate, not to use as guarantee! Every chunk would have eventual adjustments */
+	guint64 estimated_chunks = MAX(rows / rows_per_file, 1);
+	guint64 estimated_step = (nmax-cutoff)/estimated_chunks+1;
+
+	while(cutoff<=nmax) {
+		/* Follow the actual key distribution, static stepping if server gives no range estimates */
+		guint64 upper = get_balanced_cutoff(conn, database, table, partition, field, cutoff, nmax);
+		if (!upper)
+			upper = cutoff+estimated_step;
+		/* Never past the end, ranges of a previous plan may go on from there */
+		upper = MIN(upper, nmax+1);
+		struct chunk *c = g_new0(struct chunk, 1);
+		c->range = g_new0(struct chunk_range, 1);
+		c->range->field = g_strdup(field);
+		c->range->lower = cutoff;
+		c->range->cursor = cutoff;
+		c->range->upper = upper;
+		c->range->slice = (upper-cutoff)/RANGE_SLICES+1;
+		c->range->nulls = nulls;
+		chunks=g_list_append(chunks,c);
+		cutoff=upper;
+		nulls=FALSE;
+	}
 	return chunks;
 }
 
+/*
+ * Bisect on EXPLAIN estimates for the upper (exclusive) bound of a chunk starting at from,
+ * so that it holds about rows_per_file rows no matter how gappy the key space is.
+ * Returns 0 when the server does not provide range estimates
+ */
+guint64 get_balanced_cutoff(MYSQL *conn, char *database, char *table, char *partition, char *field, guint64 from, guint64 nmax) {
+	guint64 lo = from+1, hi = nmax+1, count;
+	guint iterations = 0;
+	char *cfrom = g_strdup_printf("%llu", (unsigned long long)from);
+	char *cto = g_strdup_printf("%llu", (unsigned long long)nmax);
+
+	/* Remaining range fits in one chunk (with a bit of slack, estimates are estimates) */
+	count = estimate_count(conn, database, table, partition, field, cfrom, cto);
+	g_free(cto);
+	if (!count) {
+		g_free(cfrom);
+		return 0;
+	}
+	if (count <= rows_per_file + rows_per_file/BALANCE_SLACK) {
+		g_free(cfrom);
+		return nmax+1;
+	}
+
+	while (lo < hi && iterations++ < BALANCE_MAX_ITERATIONS) {
+		guint64 mid = lo + (hi-lo)/2;
+		cto = g_strdup_printf("%llu", (unsigned long long)mid-1);
+		count = estimate_count(conn, database, table, partition, field, cfrom, cto);
+		g_free(cto);
+
+		if (count + rows_per_file/BALANCE_SLACK >= rows_per_file && count <= rows_per_file + rows_per_file/BALANCE_SLACK) {
+			lo = mid;
+			break;
+		}
+		if (count < rows_per_file)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	g_free(cfrom);
+
+	return lo;
+}
+
 /* Try to get EXPLAIN'ed estimates of row in resultset */
-guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, char *from, char *to) {
-	char *querybase, *query;
+guint64 estimate_count(MYSQL *conn, char *database, char *table, char *partition, char *field, char *from, char *to) {
+	char *querybase, *query, *source;
 	int ret;
 
 	g_assert(conn && database && table);
 
-	querybase = g_strdup_printf("EXPLAIN SELECT `%s` FROM `%s`.`%s`", (field?field:"*"), database, table);
+	source = table_source(database, table, partition);
+	querybase = g_strdup_printf("EXPLAIN SELECT `%s` FROM %s", (field?field:"*"), source);
+	g_free(source);
 	if (from || to) {
 		g_assert(field != NULL);
 		char *fromclause=NULL, *toclause=NULL;
@@ -550,11 +1994,11 @@ guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, ch
 		}
 		if (to) {
 			escaped=g_new(char,strlen(to)*2+1);
-			mysql_real_escape_string(conn,escaped,from,strlen(from));
+			mysql_real_escape_string(conn,escaped,to,strlen(to));
 			toclause = g_strdup_printf( " `%s` <= \"%s\"", field, escaped);
 			g_free(escaped);
 		}
-		query = g_strdup_printf("%s WHERE `%s` %s %s", querybase, (from?fromclause:""), ((from&&to)?"AND":""), (to?toclause:""));
+		query = g_strdup_printf("%s WHERE %s %s %s", querybase, (from?fromclause:""), ((from&&to)?"AND":""), (to?toclause:""));
 
 		if (toclause) g_free(toclause);
 		if (fromclause) g_free(fromclause);
@@ -571,6 +2015,8 @@ guint64 estimate_count(MYSQL *conn, char *database, char *table, char *field, ch
 	}
 
 	MYSQL_RES *result = mysql_store_result(conn);
+	if (!result)
+		return 0;
 	MYSQL_FIELD *fields = mysql_fetch_fields(result);
 	
 	guint i;
@@ -608,208 +2054,1333 @@ void create_backup_dir(char *directory) {
 	}
 }
 
-void dump_database(MYSQL * conn, char *database, struct configuration *conf) {
-	mysql_select_db(conn,database);
-	if (mysql_query(conn, (ignore?"SHOW TABLE STATUS":"SHOW /*!50000 FULL */ TABLES"))) {
-		g_critical("Error: DB: %s - Could not execute query: %s", database, mysql_error(conn));
-		return;
+/* Key of an instance group in the --instances file, fallback (the command line value) if it isn't set there */
+gchar *instance_string(GKeyFile *keyfile, const gchar *group, const gchar *key, gchar *fallback) {
+	gchar *value = g_key_file_get_string(keyfile, group, key, NULL);
+	return value ? value : fallback;
+}
+
+/* Point the globals at the instance of group, a child process dumps it with threads connections from here on */
+void setup_instance(GKeyFile *keyfile, const gchar *group, guint threads) {
+	hostname = instance_string(keyfile, group, "host", hostname);
+	socket_path = instance_string(keyfile, group, "socket", socket_path);
+	username = instance_string(keyfile, group, "user", username);
+	password = instance_string(keyfile, group, "password", password);
+	db = instance_string(keyfile, group, "database", db);
+	tables_list = instance_string(keyfile, group, "tables-list", tables_list);
+	regexstring = instance_string(keyfile, group, "regex", regexstring);
+	if (g_key_file_has_key(keyfile, group, "port", NULL))
+		port = g_key_file_get_integer(keyfile, group, "port", NULL);
+	num_threads = threads;
+
+	/* Everything read or written per dump gets a place of its own */
+	directory = instance_string(keyfile, group, "outputdir", g_strdup_printf("%s/%s", directory, group));
+	if (incremental_from)
+		incremental_from = g_strdup_printf("%s/%s", incremental_from, group);
+	if (differential_from)
+		differential_from = g_strdup_printf("%s/%s", differential_from, group);
+	if (stats_file)
+		stats_file = g_strdup_printf("%s.%s", stats_file, group);
+	if (trace_file)
+		trace_file = g_strdup_printf("%s.%s", trace_file, group);
+}
+
+/*
+ * --instances: dump every instance (key file group) in a process of its own running the usual dump.
+ * This is admission control only, there is no scheduler shared between instances: every instance runs
+ * exactly its threads key worth of connections, and instances start in file order while they fit into the
+ * --threads budget. Connections freed by a finished instance go to instances not started yet, never to
+ * running ones. Returns in the child only
+ */
+void run_instances(void) {
+	GKeyFile *keyfile = g_key_file_new();
+	GError *error = NULL;
+	gsize ngroups, next = 0, i;
+	guint used = 0, running = 0, failed = 0;
+	time_t t;
+
+	if (stream_output || replicas_list || target_host || target_socket) {
+		g_critical("--instances can't be combined with --stream, --replicas or a clone target");
+		exit(EXIT_FAILURE);
+	}
+	if (!g_key_file_load_from_file(keyfile, instances_file, G_KEY_FILE_NONE, &error)) {
+		g_critical("Couldn't read instances file %s: %s", instances_file, error->message);
+		exit(EXIT_FAILURE);
+	}
+	gchar **groups = g_key_file_get_groups(keyfile, &ngroups);
+	if (!ngroups || !num_threads) {
+		g_critical("Nothing to dump, %s lists no instances or --threads is 0", instances_file);
+		exit(EXIT_FAILURE);
 	}
-	
-	MYSQL_RES *result = mysql_store_result(conn);
-	guint num_fields = mysql_num_fields(result);
 
-	int i;
-	MYSQL_ROW row;
-	while ((row = mysql_fetch_row(result))) {
-		
-		int dump=1;
-
-		/* We no care about views!
-		 *    num_fields>1 kicks in only in case of 5.0 SHOW FULL TABLES or SHOW TABLE STATUS
-		 *    row[1] == NULL if it is a view in 5.0 'SHOW TABLE STATUS'
-		 *    row[1] == "VIEW" if it is a view in 5.0 'SHOW FULL TABLES'
-		 */
-		if (num_fields>1 && ( row[1] == NULL || !strcmp(row[1],"VIEW") ))
-			continue;
+	time(&t);localtime_r(&t,&tval);
+	if (!directory)
+		directory = g_strdup_printf("%s-%04d%02d%02d-%02d%02d%02d",DIRECTORY,
+			tval.tm_year+1900, tval.tm_mon+1, tval.tm_mday,
+			tval.tm_hour, tval.tm_min, tval.tm_sec);
+	create_backup_dir(directory);
 
-		/* Skip ignored engines, handy for avoiding Merge, Federated or Blackhole :-) dumps */
-		if (ignore) {
-			for (i = 0; ignore[i] != NULL; i++) {
-				if (g_ascii_strcasecmp(ignore[i], row[1]) == 0) {
-					dump = 0;
-					break;
-				}
+	guint *threads = g_new(guint, ngroups);
+	pid_t *pids = g_new0(pid_t, ngroups);
+	for (i = 0; i < ngroups; i++) {
+		gint n = g_key_file_has_key(keyfile, groups[i], "threads", NULL) ?
+			g_key_file_get_integer(keyfile, groups[i], "threads", NULL) : INSTANCE_THREADS;
+		threads[i] = CLAMP(n, 1, (gint)num_threads);
+	}
+
+	while (next < ngroups || running) {
+		while (next < ngroups && used + threads[next] <= num_threads) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				g_critical("Couldn't start dump of %s (%d)", groups[next], errno);
+				exit(EXIT_FAILURE);
+			}
+			if (!pid) {
+				setup_instance(keyfile, groups[next], threads[next]);
+				return;
 			}
+			g_message("Dumping %s with %u threads", groups[next], threads[next]);
+			pids[next] = pid;
+			used += threads[next];
+			running++;
+			next++;
 		}
-	        /* In case of table-list option is enabled, check if table is part of the list */
-		if (tables) {
-			int table_found=0;
-			for (i = 0; tables[i] != NULL; i++)
-				if (g_ascii_strcasecmp(tables[i], row[0]) == 0)
-					table_found = 1;
 
-			if (!table_found)
-				dump = 0;
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			g_critical("Lost track of instance dumps (%d)", errno);
+			exit(EXIT_FAILURE);
 		}
-
-		if (!dump)
+		for (i = 0; i < next && pids[i] != pid; i++);
+		if (i == next)
 			continue;
+		used -= threads[i];
+		running--;
+		if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+			g_message("Finished dump of %s", groups[i]);
+		} else {
+			g_critical("Dump of %s failed", groups[i]);
+			failed++;
+		}
+	}
+
+	if (failed)
+		g_critical("%u of %u instance dumps failed", failed, (guint)ngroups);
+	exit(failed ? EXIT_FAILURE : 0);
+}
+
+/*
+ * All tables come from a single information_schema.TABLES query, biggest first.
+ * Jobs are released to workers while discovery goes on, as soon as nothing planned later can be bigger
+ */
+void dump_catalog(MYSQL *conn, struct configuration *conf) {
+	GString *query = g_string_new("SELECT TABLE_SCHEMA, TABLE_NAME, ENGINE, DATA_LENGTH, TABLE_ROWS, CREATE_OPTIONS"
+		" FROM information_schema.TABLES WHERE TABLE_TYPE='BASE TABLE'");
+	if (db) {
+		gchar *escaped = g_new(gchar, strlen(db)*2+1);
+		mysql_real_escape_string(conn, escaped, db, strlen(db));
+		g_string_append_printf(query, " AND TABLE_SCHEMA='%s'", escaped);
+		g_free(escaped);
+	}
+	g_string_append(query, " ORDER BY DATA_LENGTH DESC");
 
-		/* Checks PCRE expressions on 'database.table' string */
-		if (regexstring && !check_regex(database,row[0]))
+	if (mysql_query(conn, query->str)) {
+		g_critical("Error: Could not list tables: %s", mysql_error(conn));
+		g_string_free(query, TRUE);
+		return;
+	}
+	g_string_free(query, TRUE);
+
+	/* Stored, the connection is needed for chunking while rows are walked */
+	MYSQL_RES *result = mysql_store_result(conn);
+	MYSQL_ROW row;
+	while ((row = mysql_fetch_row(result))) {
+		if (!table_selected(row[0], row[1], row[2]))
+			continue;
+		if (clone_output && !clone_schema(conn, row[0], row[1]))
 			continue;
 
 		/* Green light! */
-		dump_table(conn, database, row[0], conf);
+		guint64 data_length = row[3] ? strtoull(row[3], NULL, 10) : 0;
+		gboolean partitioned = row[5] && strstr(row[5], "partitioned");
+		dump_table(conn, row[0], row[1], data_length, row[4] ? strtoull(row[4], NULL, 10) : 0, partitioned, conf);
+
+		/* Tables come biggest first, so no job planned from here on is bigger than this table */
+		release_jobs(conf, data_length);
 	}
 	mysql_free_result(result);
 }
 
-void dump_table_data_file(MYSQL *conn, char *database, char *table, char *where, char *filename)
+void dump_table_data_file(MYSQL *conn, struct pipeline *pl, struct job *job)
 {
-	void *outfile;
-	
-	if (!compress_output)
-		outfile = g_fopen(filename, "w");
-	else
-		outfile = gzopen(filename, "w");
-
-	if (!outfile) {
-		g_critical("Error: DB: %s TABLE: %s Could not create output file %s (%d)", database, table, filename, errno);
-		return;
-	}
-	guint64 row_count = dump_table_data(conn, (FILE *)outfile, database, table, where);
-	if (!compress_output)
-		fclose((FILE *)outfile);
-	else
-		gzclose(outfile);
-
-	if (!row_count && !build_empty_files) {
-		// dropping the useless file
-		if (remove(filename)) {
-			g_warning("failed to remove empty file : %s\n", filename);
+	char *database = job->database, *table = job->table, *filename = job->filename;
+	struct configuration *conf = job->conf;
+	guint64 row_count;
+	guint64 start = trace_now();
+
+	stats_set_table(pl->stats, database, table);
+
+	/* Unchanged since the previous dump, reuse its file instead of reading the rows again */
+	if (job->checksum_columns) {
+		job->checksum = chunk_checksum(conn, job);
+		trace_end("checksum", start, filename);
+		if (job->checksum && link_previous_chunk(job)) {
+			pl->stats->chunks_done++;
+			trace_end("chunk", start, filename);
 			return;
 		}
 	}
-}
-
-void dump_table(MYSQL *conn, char *database, char *table, struct configuration *conf) {
 
-	GList * chunks = NULL; 
+	/* Nothing is in flight between jobs, write stage takes over from here */
+	pl->filename = filename;
+	pl->part = 0;
+	pl->failed = FALSE;
+	if (pl->target) {
+		if (mysql_select_db(pl->target, database)) {
+			g_critical("Error: DB: %s TABLE: %s Could not use database on clone target: %s", database, table, mysql_error(pl->target));
+			g_atomic_int_inc(&failed_jobs);
+			return;
+		}
+	} else {
+		struct output_file *outfile = output_open(filename, output_codec);
+		if (!outfile) {
+			g_critical("Error: DB: %s TABLE: %s Could not create output file %s (%d)", database, table, filename, errno);
+			g_atomic_int_inc(&failed_jobs);
+			return;
+		}
+		pl->file = outfile;
+		pl->written = write_file_header(outfile);
+	}
 
-	if (rows_per_file)
-		chunks = get_chunks_for_table(conn, database, table, conf);
+	if (job->range) {
+		g_mutex_lock(conf->mutex);
+		conf->running = g_list_prepend(conf->running, job);
+		g_mutex_unlock(conf->mutex);
 
-	if (chunks) {
-		int nchunk = 0;
-		for (chunks = g_list_first(chunks); chunks; chunks=g_list_next(chunks)) {
-			struct job *j = g_new0(struct job, 1);
-			j->database=g_strdup(database);
-			j->table=g_strdup(table);
-			j->conf=conf;
-			j->type=JOB_DUMP;
-			j->filename=g_strdup_printf("%s/%s.%s.%05d.sql%s", directory, database, table, nchunk,(compress_output?".gz":""));
-			j->where=(char *)chunks->data;
-			g_async_queue_push(conf->queue,j);
-			nchunk++;
-		}
-		g_list_free(g_list_first(chunks));
+		row_count = dump_table_range(conn, pl, job);
+
+		g_mutex_lock(conf->mutex);
+		conf->running = g_list_remove(conf->running, job);
+		g_mutex_unlock(conf->mutex);
 	} else {
+		row_count = dump_table_data(conn, pl, database, table, job->partition, job->where);
+	}
+
+	/* Write stage may have rolled over to another file */
+	int write_error = 0;
+	guint64 close_start = trace_now();
+	if (pl->file && (write_error = output_close(pl->file)))
+		g_critical("Error: DB: %s TABLE: %s Could not write output file %s (%d)", database, table, filename, errno);
+	pl->file = NULL;
+	trace_end("close", close_start, NULL);
+
+	if (!row_count && !build_empty_files && !stream_output && !pl->target) {
+		// dropping the useless file
+		if (remove(filename)) {
+			g_warning("failed to remove empty file : %s\n", filename);
+			return;
+		}
+	}
+
+	/* Output is synced by now, a resumed dump can skip this job */
+	if (write_error || pl->failed)
+		g_atomic_int_inc(&failed_jobs);
+	else
+		manifest_done(job, row_count, job_output_bytes(job, pl->part));
+	pl->stats->chunks_done++;
+	trace_end("chunk", start, filename);
+}
+
+gchar *range_where(char *field, guint64 lower, guint64 upper, gboolean nulls) {
+	return g_strdup_printf("%s%s(`%s` >= %llu AND `%s` < %llu)",
+			nulls?field:"",
+			nulls?" IS NULL OR ":"",
+			field, (unsigned long long)lower,
+			field, (unsigned long long)upper);
+}
+
+/* FROM clause for a table, restricted to one partition when given */
+gchar *table_source(char *database, char *table, char *partition) {
+	if (partition)
+		return g_strdup_printf("`%s`.`%s` PARTITION (`%s`)", database, table, partition);
+	return g_strdup_printf("`%s`.`%s`", database, table);
+}
+
+/* Partitions of a table in definition order, subpartitions instead of their parents, NULL if there are none */
+GList *get_partitions(MYSQL *conn, char *database, char *table) {
+	GList *partitions = NULL;
+	gchar *edb = g_new(gchar, strlen(database)*2+1), *etable = g_new(gchar, strlen(table)*2+1);
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+
+	mysql_real_escape_string(conn, edb, database, strlen(database));
+	mysql_real_escape_string(conn, etable, table, strlen(table));
+	gchar *query = g_strdup_printf("SELECT COALESCE(SUBPARTITION_NAME, PARTITION_NAME), DATA_LENGTH, TABLE_ROWS"
+		" FROM information_schema.PARTITIONS WHERE TABLE_SCHEMA='%s' AND TABLE_NAME='%s' AND PARTITION_NAME IS NOT NULL"
+		" ORDER BY PARTITION_ORDINAL_POSITION, SUBPARTITION_ORDINAL_POSITION", edb, etable);
+	g_free(edb);
+	g_free(etable);
+
+	if (mysql_query(conn, query) || !(result = mysql_store_result(conn))) {
+		g_warning("Unable to list partitions of %s.%s, dumping it whole: %s", database, table, mysql_error(conn));
+		g_free(query);
+		return NULL;
+	}
+	g_free(query);
+
+	while ((row = mysql_fetch_row(result))) {
+		struct partition *p = g_new0(struct partition, 1);
+		p->name = g_strdup(row[0]);
+		p->data_length = row[1] ? strtoull(row[1], NULL, 10) : 0;
+		p->rows = row[2] ? strtoull(row[2], NULL, 10) : 0;
+		partitions = g_list_prepend(partitions, p);
+	}
+	mysql_free_result(result);
+	return g_list_reverse(partitions);
+}
+
+/*
+ * Dump a range job piece by piece, every piece is claimed before it is read so stealers only get unclaimed keys.
+ * Nobody steals while jobs are queued, so half of what is left is claimed at a time, a handful of queries per job.
+ * Once workers run out of jobs each of them is left an equal share to steal from
+ */
+guint64 dump_table_range(MYSQL *conn, struct pipeline *pl, struct job *job) {
+	struct chunk_range *range = job->range;
+	struct configuration *conf = job->conf;
+	guint64 num_rows = 0;
+
+	for (;;) {
+		g_mutex_lock(conf->mutex);
+		guint64 lower = range->cursor;
+		if (lower >= range->upper) {
+			g_mutex_unlock(conf->mutex);
+			break;
+		}
+		guint64 remaining = range->upper - lower;
+		guint64 claim = MAX(remaining / MAX(2, conf->idle + 1), range->slice);
+		/* Not worth leaving less than a slice behind */
+		if (remaining - MIN(claim, remaining) < range->slice)
+			claim = remaining;
+		guint64 upper = lower + claim;
+		gboolean nulls = range->nulls && lower == range->lower;
+		range->cursor = upper;
+		g_mutex_unlock(conf->mutex);
+
+		char *where = range_where(range->field, lower, upper, nulls);
+		num_rows += dump_table_data(conn, pl, job->database, job->table, job->partition, where);
+		g_free(where);
+	}
+	return num_rows;
+}
+
+/*
+ * Completion manifest (.manifest in the export directory).
+ * Every planned job gets a PLANNED line (re-written when its range is split), and a DONE line
+ * once its output is closed and synced, so an interrupted dump can be picked up with --resume
+ */
+void manifest_open(gboolean append) {
+	char *p = g_strdup_printf("%s/.manifest", directory);
+	manifest = g_fopen(p, append ? "a" : "w");
+	if (!manifest) {
+		g_critical("Couldn't write manifest file %s (%d)", p, errno);
+		exit(EXIT_FAILURE);
+	}
+	g_free(p);
+	manifest_mutex = g_mutex_new();
+}
+
+void manifest_close(void) {
+	if (!manifest)
+		return;
+	fclose(manifest);
+	g_mutex_free(manifest_mutex);
+}
+
+static void manifest_sync_unlocked(void) {
+	fflush(manifest);
+	fsync(fileno(manifest));
+}
+
+void manifest_sync(void) {
+	if (!manifest)
+		return;
+	g_mutex_lock(manifest_mutex);
+	manifest_sync_unlocked();
+	g_mutex_unlock(manifest_mutex);
+}
+
+/* Every table is planned, only from here on the manifest can be resumed. Synced, so are all PLANNED lines before it */
+void manifest_complete(void) {
+	if (!manifest)
+		return;
+	g_mutex_lock(manifest_mutex);
+	fputs("COMPLETE\n", manifest);
+	manifest_sync_unlocked();
+	g_mutex_unlock(manifest_mutex);
+}
+
+/* WHERE clause a job dumps, ranges are written out as they stand now */
+gchar *job_where(struct job *job) {
+	if (job->range)
+		return range_where(job->range->field, job->range->lower, job->range->upper, job->range->nulls);
+	return g_strdup(job->where ? job->where : "");
+}
+
+void manifest_planned(struct job *job) {
+	if (!manifest)
+		return;
+
+	gchar *where = job_where(job);
+	gchar *escaped = g_strescape(where, NULL);
+	gchar *base = g_path_get_basename(job->filename);
+
+	g_mutex_lock(manifest_mutex);
+	fprintf(manifest, "PLANNED\t%s\t%s\t%s\t%llu\t%s\t%s\n", base, job->database, job->table,
+		(unsigned long long)job->bytes, escaped, job->partition ? job->partition : "");
+	g_mutex_unlock(manifest_mutex);
+
+	g_free(base);
+	g_free(escaped);
+	g_free(where);
+}
+
+void manifest_done(struct job *job, guint64 rows, guint64 bytes) {
+	if (!manifest)
+		return;
+
+	gchar *base = g_path_get_basename(job->filename);
+	/* Checksum only covers the planned range, not what is left of it after a steal */
+	const char *checksum = (job->checksum && !(job->range && job->range->steals)) ? job->checksum : "";
+
+	g_mutex_lock(manifest_mutex);
+	fprintf(manifest, "DONE\t%s\t%llu\t%llu\t%s\n", base, (unsigned long long)rows, (unsigned long long)bytes, checksum);
+	manifest_sync_unlocked();
+	g_mutex_unlock(manifest_mutex);
+
+	g_free(base);
+}
+
+/* Latest state of every chunk in the manifest of dir, keyed by file name, NULL if there is no manifest */
+GHashTable *read_manifest(const char *dir, gboolean *complete) {
+	gchar *contents = NULL;
+	gchar *p = g_strdup_printf("%s/.manifest", dir);
+	guint i;
+
+	if (!g_file_get_contents(p, &contents, NULL, NULL)) {
+		g_free(p);
+		return NULL;
+	}
+	g_free(p);
+
+	GHashTable *entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)free_manifest_entry);
+	gchar **lines = g_strsplit(contents, "\n", 0);
+	g_free(contents);
+
+	for (i = 0; lines[i]; i++) {
+		gchar **fields = g_strsplit(lines[i], "\t", 0);
+		guint n = g_strv_length(fields);
+		struct manifest_entry *e = n >= 2 ? g_hash_table_lookup(entries, fields[1]) : NULL;
+
+		if (n == 1 && !strcmp(fields[0], "COMPLETE") && complete) {
+			*complete = TRUE;
+		} else if ((n == 6 || n == 7) && !strcmp(fields[0], "PLANNED")) {
+			/* Manifests from before partition support have no partition field */
+			if (!e) {
+				e = g_new0(struct manifest_entry, 1);
+				e->database = g_strdup(fields[2]);
+				e->table = g_strdup(fields[3]);
+				e->partition = (n == 7 && fields[6][0]) ? g_strdup(fields[6]) : NULL;
+				g_hash_table_insert(entries, g_strdup(fields[1]), e);
+			}
+			/* Later lines win, a split range is planned again with its new bounds */
+			g_free(e->where);
+			e->where = fields[5][0] ? g_strcompress(fields[5]) : NULL;
+			e->bytes = strtoull(fields[4], NULL, 10);
+		} else if (n >= 4 && !strcmp(fields[0], "DONE") && e) {
+			e->done = TRUE;
+			e->rows = strtoull(fields[2], NULL, 10);
+			e->bytes = strtoull(fields[3], NULL, 10);
+			g_free(e->checksum);
+			e->checksum = (n >= 5 && fields[4][0]) ? g_strdup(fields[4]) : NULL;
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	return entries;
+}
+
+void free_manifest_entry(struct manifest_entry *e) {
+	g_free(e->database);
+	g_free(e->table);
+	g_free(e->partition);
+	g_free(e->where);
+	g_free(e->checksum);
+	g_free(e);
+}
+
+/*
+ * Requeue everything the manifest has planned but not finished. Leftovers of unfinished
+ * jobs are removed first. Resumed jobs dump their recorded WHERE clause and are not split again
+ */
+void resume_jobs(struct configuration *conf) {
+	gboolean complete = FALSE;
+	GHashTable *entries = read_manifest(directory, &complete);
+	GHashTableIter iter;
+	gchar *base;
+	struct manifest_entry *e;
+	guint resumed = 0;
+
+	if (!entries) {
+		g_critical("Couldn't read manifest file %s/.manifest, nothing to resume", directory);
+		exit(EXIT_FAILURE);
+	}
+	/* Jobs are dumped while discovery goes on, tables not planned yet are nowhere in the manifest */
+	if (!complete) {
+		g_critical("Dump in %s was interrupted before all tables were planned, it has to be taken again", directory);
+		exit(EXIT_FAILURE);
+	}
+
+	g_hash_table_iter_init(&iter, entries);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&base, (gpointer *)&e)) {
+		if (e->done)
+			continue;
+
+		struct job *j = g_new0(struct job, 1);
+		j->type = JOB_DUMP;
+		j->conf = conf;
+		j->database = g_strdup(e->database);
+		j->table = g_strdup(e->table);
+		j->partition = g_strdup(e->partition);
+		j->filename = g_strdup_printf("%s/%s", directory, base);
+		j->where = g_strdup(e->where);
+		j->bytes = e->bytes;
+
+		/* Partial output, including rolled over parts */
+		guint part = 1;
+		g_remove(j->filename);
+		for (;;) {
+			gchar *name = filename_part(j->filename, part++);
+			int ret = g_remove(name);
+			g_free(name);
+			if (ret)
+				break;
+		}
+		g_tree_insert(conf->pending, j, j);
+		resumed++;
+	}
+	g_hash_table_destroy(entries);
+
+	g_message("Resuming dump in %s, %u chunks left to dump", directory, resumed);
+}
+
+/* Row count and BIT_XOR of row CRC32s over the rows a job dumps, read in the worker's snapshot */
+gchar *chunk_checksum(MYSQL *conn, struct job *job) {
+	gchar *where = job_where(job);
+	gchar *source = table_source(job->database, job->table, job->partition);
+	gchar *query = g_strdup_printf("SELECT COUNT(*), BIT_XOR(CRC32(%s)) FROM %s %s %s", job->checksum_columns,
+		source, where[0] ? "WHERE" : "", where);
+	gchar *checksum = NULL;
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+
+	g_free(where);
+	g_free(source);
+	if (mysql_query(conn, query)) {
+		g_warning("Error checksumming %s.%s, dumping it again: %s", job->database, job->table, mysql_error(conn));
+		g_free(query);
+		return NULL;
+	}
+	g_free(query);
+
+	result = mysql_store_result(conn);
+	if (result && (row = mysql_fetch_row(result)))
+		checksum = g_strdup_printf("%s:%s", row[0], row[1] ? row[1] : "0");
+	if (result)
+		mysql_free_result(result);
+	return checksum;
+}
+
+/* Hard link the output of an unchanged chunk from the previous dump, FALSE if it has to be dumped */
+gboolean link_previous_chunk(struct job *job) {
+	gchar *base = g_path_get_basename(job->filename);
+	struct manifest_entry *e = g_hash_table_lookup(previous_chunks, base);
+	gchar *where = job_where(job);
+	gboolean linked = FALSE;
+	guint part = 0;
+
+	/* Same file name, same rows and a file to link to (empty chunks are cheap to dump again) */
+	if (!e || !e->done || !e->checksum || !e->rows || strcmp(e->checksum, job->checksum) || strcmp(e->where ? e->where : "", where)
+			|| g_strcmp0(e->partition, job->partition))
+		goto cleanup;
+
+	gchar *source = g_strdup_printf("%s/%s", differential_from, base);
+	for (;; part++) {
+		gchar *from = part ? filename_part(source, part) : g_strdup(source);
+		gchar *to = part ? filename_part(job->filename, part) : g_strdup(job->filename);
+		int ret = link(from, to);
+		int link_errno = errno;
+		g_free(from);
+		g_free(to);
+
+		if (!ret)
+			continue;
+		/* Parts end where the previous dump stopped rolling over */
+		if (part && link_errno == ENOENT) {
+			linked = TRUE;
+		} else {
+			g_warning("Couldn't link %s from previous dump, dumping it again (%d)", base, link_errno);
+			while (part--) {
+				gchar *name = part ? filename_part(job->filename, part) : g_strdup(job->filename);
+				g_remove(name);
+				g_free(name);
+			}
+		}
+		break;
+	}
+	g_free(source);
+
+	if (linked)
+		manifest_done(job, e->rows, e->bytes);
+
+cleanup:
+	g_free(where);
+	g_free(base);
+	return linked;
+}
+
+static void free_ptr_array(gpointer array) {
+	g_ptr_array_free(array, TRUE);
+}
+
+/* File names of a manifest grouped by "database.table", the names stay owned by chunks */
+GHashTable *index_previous_chunks(GHashTable *chunks) {
+	GHashTable *index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_ptr_array);
+	GHashTableIter iter;
+	gchar *base;
+	struct manifest_entry *e;
+
+	g_hash_table_iter_init(&iter, chunks);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&base, (gpointer *)&e)) {
+		gchar *key = g_strdup_printf("%s.%s", e->database, e->table);
+		GPtrArray *files = g_hash_table_lookup(index, key);
+		if (!files) {
+			files = g_ptr_array_new();
+			g_hash_table_insert(index, key, files);
+		} else {
+			g_free(key);
+		}
+		g_ptr_array_add(files, base);
+	}
+	return index;
+}
+
+/* Bounds of a WHERE clause written by range_where(), FALSE for anything else */
+gboolean parse_range_where(const char *where, gchar **field, guint64 *lower, guint64 *upper, gboolean *nulls) {
+	const char *open, *ge, *lt;
+
+	if (!where || !(open = strstr(where, "(`")) || !(ge = strstr(open, "` >= ")) || !(lt = g_strrstr(where, "` < ")))
+		return FALSE;
+	*field = g_strndup(open + 2, ge - open - 2);
+	*lower = strtoull(ge + 5, NULL, 10);
+	*upper = strtoull(lt + 4, NULL, 10);
+	*nulls = where[0] != '(';
+
+	/* Written back the same way or it is no range of ours */
+	gchar *check = range_where(*field, *lower, *upper, *nulls);
+	gboolean same = !strcmp(check, where);
+	g_free(check);
+	if (!same)
+		g_free(*field);
+	return same;
+}
+
+/*
+ * Whether every chunk a previous dump had of a table is an integer range, so it can be planned the same way again.
+ * next is set past the highest file number used
+ */
+gboolean previous_ranges_usable(GPtrArray *previous, char *database, char *table, guint *next) {
+	gchar *prefix = g_strdup_printf("%s.%s.", database, table);
+	gboolean usable = TRUE;
+	guint i;
+
+	*next = 0;
+	for (i = 0; i < previous->len && usable; i++) {
+		gchar *base = g_ptr_array_index(previous, i);
+		struct manifest_entry *e = g_hash_table_lookup(previous_chunks, base);
+		gchar *field;
+		guint64 lower, upper;
+		gboolean nulls;
+
+		if (!g_str_has_prefix(base, prefix) || !g_ascii_isdigit(base[strlen(prefix)]) || !parse_range_where(e->where, &field, &lower, &upper, &nulls)) {
+			usable = FALSE;
+			break;
+		}
+		g_free(field);
+		*next = MAX(*next, (guint)strtoul(base + strlen(prefix), NULL, 10) + 1);
+	}
+	g_free(prefix);
+	return usable;
+}
+
+static gint range_lower_compare(gconstpointer a, gconstpointer b) {
+	const struct chunk *ca = a, *cb = b;
+
+	return ca->range->lower < cb->range->lower ? -1 : ca->range->lower > cb->range->lower;
+}
+
+/*
+ * --differential: the integer ranges a previous dump had of a table (or partition), with their WHERE clauses and
+ * file names, so unchanged ones can be linked. Keys below and above them, appended rows mostly, get new ranges.
+ * NULL if they can't be planned that way, the ranges don't line up or the key is no integer anymore
+ */
+GList *get_previous_chunks(MYSQL *conn, char *database, char *table, char *partition, GPtrArray *previous) {
+	GList *chunks = NULL, *l;
+	gchar *field = NULL;
+	guint nulls = 0, i, j;
+
+	for (i = 0; i < previous->len; i++) {
+		gchar *base = g_ptr_array_index(previous, i);
+		struct manifest_entry *e = g_hash_table_lookup(previous_chunks, base);
+		if (g_strcmp0(e->partition, partition))
+			continue;
+
+		struct chunk *c = g_new0(struct chunk, 1);
+		c->range = g_new0(struct chunk_range, 1);
+		parse_range_where(e->where, &c->range->field, &c->range->lower, &c->range->upper, &c->range->nulls);
+		c->range->cursor = c->range->lower;
+		c->range->slice = (c->range->upper - c->range->lower)/RANGE_SLICES+1;
+		chunks = g_list_prepend(chunks, c);
+		if (c->range->nulls)
+			nulls++;
+		if (!field)
+			field = c->range->field;
+		else if (strcmp(field, c->range->field))
+			goto fail;
+
+		/* Same name, in the current codec, stealing numbers after the pieces stolen from it last time */
+		gchar *stem = g_strndup(base, g_strrstr(base, ".sql") - base);
+		c->filename = g_strdup_printf("%s/%s.sql%s", directory, stem, codec_extension(output_codec));
+		for (j = 0; j < previous->len; j++) {
+			gchar *other = g_ptr_array_index(previous, j);
+			gsize len = strlen(stem);
+			if (!strncmp(other, stem, len) && other[len] == '-' && g_ascii_isdigit(other[len+1]))
+				c->range->stolen_before = MAX(c->range->stolen_before, (guint)strtoul(other + len + 1, NULL, 10));
+		}
+		g_free(stem);
+	}
+	if (!chunks)
+		return NULL;
+
+	/* Pieces have to cover the key space between them exactly once, NULLs included */
+	chunks = g_list_sort(chunks, range_lower_compare);
+	for (l = chunks; l->next; l = l->next) {
+		if (((struct chunk *)l->data)->range->upper != ((struct chunk *)l->next->data)->range->lower)
+			goto fail;
+	}
+	if (nulls != 1 || !((struct chunk *)chunks->data)->range->nulls)
+		goto fail;
+
+	gchar *source = table_source(database, table, partition);
+	gchar *query = g_strdup_printf("SELECT MIN(`%s`),MAX(`%s`) FROM %s", field, field, source);
+	g_free(source);
+	if (mysql_query(conn, query)) {
+		g_free(query);
+		goto fail;
+	}
+	g_free(query);
+	MYSQL_RES *minmax = mysql_store_result(conn);
+	MYSQL_ROW row = minmax ? mysql_fetch_row(minmax) : NULL;
+	if (!row || (mysql_fetch_fields(minmax)[0].type != MYSQL_TYPE_LONG && mysql_fetch_fields(minmax)[0].type != MYSQL_TYPE_LONGLONG
+			&& mysql_fetch_fields(minmax)[0].type != MYSQL_TYPE_INT24)) {
+		if (minmax)
+			mysql_free_result(minmax);
+		goto fail;
+	}
+
+	/* Empty table, the previous ranges alone are cheap enough */
+	if (row[0] && row[1]) {
+		guint64 nmin = strtoll(row[0], NULL, 10), nmax = strtoll(row[1], NULL, 10);
+		guint64 first = ((struct chunk *)chunks->data)->range->lower;
+		guint64 last = ((struct chunk *)g_list_last(chunks)->data)->range->upper;
+		gchar *from, *to;
+
+		if (nmin < first) {
+			from = g_strdup_printf("%llu", (unsigned long long)nmin);
+			to = g_strdup_printf("%llu", (unsigned long long)first-1);
+			chunks = g_list_concat(get_range_chunks(conn, database, table, partition, field, nmin, first-1,
+				estimate_count(conn, database, table, partition, field, from, to), FALSE), chunks);
+			g_free(from);
+			g_free(to);
+		}
+		if (nmax >= last) {
+			from = g_strdup_printf("%llu", (unsigned long long)last);
+			to = g_strdup_printf("%llu", (unsigned long long)nmax);
+			chunks = g_list_concat(chunks, get_range_chunks(conn, database, table, partition, field, last, nmax,
+				estimate_count(conn, database, table, partition, field, from, to), FALSE));
+			g_free(from);
+			g_free(to);
+		}
+	}
+	mysql_free_result(minmax);
+	return chunks;
+
+fail:
+	for (l = chunks; l; l = l->next) {
+		struct chunk *c = (struct chunk *)l->data;
+		g_free(c->range->field);
+		g_free(c->range);
+		g_free(c->filename);
+		g_free(c);
+	}
+	g_list_free(chunks);
+	return NULL;
+}
+
+/* Checksum input of a row: all columns, plus NULL flags as CONCAT_WS skips NULLs */
+gchar *get_checksum_columns(MYSQL *conn, char *database, char *table) {
+	gchar *query = g_strdup_printf("SELECT * FROM `%s`.`%s` LIMIT 0", database, table);
+	MYSQL_RES *result;
+	guint i;
+
+	if (mysql_query(conn, query) || !(result = mysql_store_result(conn))) {
+		g_warning("Couldn't read columns of %s.%s, it will be dumped in full: %s", database, table, mysql_error(conn));
+		g_free(query);
+		return NULL;
+	}
+	g_free(query);
+
+	MYSQL_FIELD *fields = mysql_fetch_fields(result);
+	guint num_fields = mysql_num_fields(result);
+	GString *columns = g_string_new("CONCAT_WS('#'");
+	for (i = 0; i < num_fields; i++)
+		g_string_append_printf(columns, ",`%s`", fields[i].name);
+	g_string_append(columns, ",CONCAT(");
+	for (i = 0; i < num_fields; i++)
+		g_string_append_printf(columns, "%sISNULL(`%s`)", i ? "," : "", fields[i].name);
+	g_string_append(columns, "))");
+	mysql_free_result(result);
+
+	return g_string_free(columns, FALSE);
+}
+
+/* Sum of output sizes of a job, including rolled over parts */
+guint64 job_output_bytes(struct job *job, guint parts) {
+	struct stat st;
+	guint64 bytes = 0;
+	guint part;
+
+	if (!g_stat(job->filename, &st))
+		bytes += st.st_size;
+	for (part = 1; part <= parts; part++) {
+		gchar *name = filename_part(job->filename, part);
+		if (!g_stat(name, &st))
+			bytes += st.st_size;
+		g_free(name);
+	}
+	return bytes;
+}
+
+/* Biggest first, everything else keeps planning order */
+gint job_size_compare(gconstpointer a, gconstpointer b) {
+	const struct job *ja = a, *jb = b;
+
+	if (ja->bytes > jb->bytes)
+		return -1;
+	if (ja->bytes < jb->bytes)
+		return 1;
+	/* Pending jobs are keyed by themselves, equal sizes still have to be distinct keys */
+	return ja < jb ? -1 : ja > jb;
+}
+
+/* Collects pending jobs, biggest first, down to the bound */
+struct release {
+	guint64 bound;
+	GPtrArray *jobs;
+};
+
+static gboolean collect_release(gpointer key, gpointer value, gpointer data) {
+	struct job *job = key;
+	struct release *release = data;
+	(void) value;
+
+	if (job->bytes < release->bound)
+		return TRUE;
+	g_ptr_array_add(release->jobs, job);
+	return FALSE;
+}
+
+/*
+ * Hand pending jobs of at least bound bytes to workers, biggest first.
+ * With bound set to the biggest job that can still be planned, workers see the same global order as if
+ * everything was planned up front; 0 releases everything
+ */
+void release_jobs(struct configuration *conf, guint64 bound) {
+	struct release release = { bound, g_ptr_array_new() };
+	guint64 rows = 0, bytes = 0;
+	guint i;
+
+	g_tree_foreach(conf->pending, collect_release, &release);
+	for (i = 0; i < release.jobs->len; i++) {
+		struct job *job = g_ptr_array_index(release.jobs, i);
+		g_tree_remove(conf->pending, job);
+		manifest_planned(job);
+		rows += job->rows;
+		bytes += job->bytes;
+		g_async_queue_push(conf->queue, job);
+	}
+	stats_plan(rows, bytes);
+	g_ptr_array_free(release.jobs, TRUE);
+}
+
+void dump_table(MYSQL *conn, char *database, char *table, guint64 data_length, guint64 table_rows, gboolean partitioned, struct configuration *conf) {
+	gchar *checksum_columns = differential_from ? get_checksum_columns(conn, database, table) : NULL;
+	GList *partitions = partitioned ? get_partitions(conn, database, table) : NULL, *l;
+	GPtrArray *previous = NULL;
+	guint nchunk = 0;
+
+	/* --differential: integer ranges are planned as last time, new chunks are numbered after the previous ones */
+	if (previous_tables && rows_per_file) {
+		gchar *key = g_strdup_printf("%s.%s", database, table);
+		previous = g_hash_table_lookup(previous_tables, key);
+		if (previous && !previous_ranges_usable(previous, database, table, &nchunk))
+			previous = NULL;
+		g_free(key);
+	}
+
+	if (partitions) {
+		/* A job per partition, pruned by the server, numbered on across the whole table */
+		for (l = partitions; l; l = l->next) {
+			struct partition *p = (struct partition *)l->data;
+			nchunk = dump_table_chunks(conn, database, table, p->name, p->data_length, p->rows, checksum_columns, previous, nchunk, conf);
+			g_free(p->name);
+			g_free(p);
+		}
+		g_list_free(partitions);
+	} else if (dump_table_chunks(conn, database, table, NULL, data_length, table_rows, checksum_columns, previous, nchunk, conf) == nchunk) {
 		struct job *j = g_new0(struct job,1);
 		j->database=g_strdup(database);
 		j->table=g_strdup(table);
 		j->conf=conf;
 		j->type=JOB_DUMP;
-		j->filename=g_strdup_printf("%s/%s.%s.sql%s", directory, database, table, (compress_output?".gz":""));
-		g_async_queue_push(conf->queue,j);
-		return;
+		j->filename=g_strdup_printf("%s/%s.%s.sql%s", directory, database, table, codec_extension(output_codec));
+		j->bytes=data_length;
+		j->rows=table_rows;
+		j->checksum_columns=g_strdup(checksum_columns);
+		g_tree_insert(conf->pending, j, j);
 	}
+	g_free(checksum_columns);
 }
 
-/* Do actual data chunk reading/writing magic */
-guint64 dump_table_data(MYSQL *conn, FILE *file, char *database, char *table, char *where)
-{
+/*
+ * Plan chunk jobs for a table, or for one of its partitions, numbering files from nchunk.
+ * A partition too small to chunk becomes a single job, a whole table is left to the caller.
+ * Returns the next file number
+ */
+guint dump_table_chunks(MYSQL *conn, char *database, char *table, char *partition, guint64 data_length, guint64 table_rows, char *checksum_columns,
+	GPtrArray *previous, guint nchunk, struct configuration *conf) {
+	GList *chunks = NULL, *l;
+	guint n;
+
+	if (previous)
+		chunks = get_previous_chunks(conn, database, table, partition, previous);
+	/* Partition statistics are as good as the table's, no need to look at indexes for small ones */
+	if (!chunks && rows_per_file && (!partition || table_rows > rows_per_file))
+		chunks = get_chunks_for_table(conn, database, table, partition, conf);
+	if (!chunks) {
+		if (!partition)
+			return nchunk;
+		/* No WHERE clause, the whole partition */
+		chunks = g_list_append(chunks, g_new0(struct chunk, 1));
+	}
+
+	n = g_list_length(chunks);
+	for (l = chunks; l; l = l->next) {
+		struct chunk *c = (struct chunk *)l->data;
+		struct job *j = g_new0(struct job, 1);
+		j->database=g_strdup(database);
+		j->table=g_strdup(table);
+		j->partition=g_strdup(partition);
+		j->conf=conf;
+		j->type=JOB_DUMP;
+		j->filename=c->filename ? c->filename : g_strdup_printf("%s/%s.%s.%05d.sql%s", directory, database, table, nchunk++, codec_extension(output_codec));
+		j->where=c->where;
+		j->range=c->range;
+		j->bytes=data_length / n;
+		j->rows=table_rows / n;
+		j->checksum_columns=g_strdup(checksum_columns);
+		g_free(c);
+		g_tree_insert(conf->pending, j, j);
+	}
+	g_list_free(chunks);
+	return nchunk;
+}
+
+/*
+ * Memory a pipeline's buffers grow to: a batch holds up to two statements worth of rows (rows bigger than a statement
+ * are never copied), a write buffer a statement plus one row escaped, or a statement plus two formatted pieces
+ */
+guint64 pipeline_memory(void) {
+	return (guint64)PIPELINE_DEPTH * (2*(guint64)statement_size + MAX(3*(guint64)statement_size, (guint64)statement_size + 4*FORMAT_PIECE_SIZE));
+}
+
+struct pipeline *pipeline_new(MYSQL *conn) {
+	struct pipeline *pl = g_new0(struct pipeline, 1);
 	guint i;
-	guint num_fields = 0;
-	guint64 num_rows = 0;
-	MYSQL_RES *result = NULL;
-	char *query = NULL;
 
-	/* Ghm, not sure if this should be statement_size - but default isn't too big for now */	
-	GString* statement = g_string_sized_new(statement_size);
+	if (!memory_reserve_buffers(pipeline_memory())) {
+		g_critical("--memory-limit is too low for the buffers of --threads %u, each thread needs %llu MB at --statement-size %u",
+			num_threads, (unsigned long long)(pipeline_memory() >> 20) + 1, statement_size);
+		exit(EXIT_FAILURE);
+	}
+
+	pl->conn = conn;
+	pl->stats = stats_register();
+	pl->format.statement_size = statement_size;
+	pl->free_batches = g_async_queue_new();
+	pl->batches = g_async_queue_new();
+	pl->free_buffers = g_async_queue_new();
+	pl->buffers = g_async_queue_new();
+	pl->done = g_async_queue_new();
+	pl->row_done = g_async_queue_new();
+
+	for (i=0; i<PIPELINE_DEPTH; i++) {
+		struct row_batch *batch = g_new0(struct row_batch, 1);
+		batch->data = g_string_sized_new(statement_size);
+		batch->lengths = g_array_new(FALSE, FALSE, sizeof(gulong));
+		g_async_queue_push(pl->free_batches, batch);
+
+		struct write_buffer *buffer = g_new0(struct write_buffer, 1);
+		buffer->data = g_string_sized_new(statement_size);
+		g_async_queue_push(pl->free_buffers, buffer);
+	}
+
+	pl->format_thread = g_thread_create((GThreadFunc)format_stage, pl, TRUE, NULL);
+	pl->write_thread = g_thread_create((GThreadFunc)write_stage, pl, TRUE, NULL);
+
+	return pl;
+}
+
+void pipeline_free(struct pipeline *pl) {
+	guint i;
+
+	/* Shutdown marker travels through both stages, every buffer ends up back on its free queue */
+	struct row_batch *batch = g_async_queue_pop(pl->free_batches);
+	batch->type = BATCH_SHUTDOWN;
+	g_async_queue_push(pl->batches, batch);
+	g_thread_join(pl->format_thread);
+	g_thread_join(pl->write_thread);
+
+	for (i=0; i<PIPELINE_DEPTH; i++) {
+		batch = g_async_queue_pop(pl->free_batches);
+		g_string_free(batch->data, TRUE);
+		g_array_free(batch->lengths, TRUE);
+		g_free(batch);
+
+		struct write_buffer *buffer = g_async_queue_pop(pl->free_buffers);
+		g_string_free(buffer->data, TRUE);
+		g_free(buffer);
+	}
+
+	g_async_queue_unref(pl->free_batches);
+	g_async_queue_unref(pl->batches);
+	g_async_queue_unref(pl->free_buffers);
+	g_async_queue_unref(pl->buffers);
+	g_async_queue_unref(pl->done);
+	g_async_queue_unref(pl->row_done);
+	if (pl->target)
+		mysql_close(pl->target);
+	if (pl->statement)
+		g_string_free(pl->statement, TRUE);
+	g_free(pl->format.formatters);
+	g_free(pl);
+	memory_release_buffers(pipeline_memory());
+}
+
+/* Turns row batches into INSERT statements, buffers are only passed on at statement boundaries */
+void *format_stage(struct pipeline *pl) {
+	struct write_buffer *out = NULL;
+	struct batch_cursor cursor;
+	guint64 start;
+
+	trace_thread("worker %u format", pl->stats->id);
+	for (;;) {
+		struct row_batch *batch = (struct row_batch *)g_async_queue_pop(pl->batches);
+		start = trace_now();
+
+		if (!out) {
+			out = (struct write_buffer *)g_async_queue_pop(pl->free_buffers);
+			out->type = BATCH_ROWS;
+		}
+
+		/* Huge row goes out in pieces as it is formatted, never escaped as a whole */
+		if (batch->type == BATCH_LARGE_ROW) {
+			struct piece_cursor piece;
+			piece_cursor_init(&piece);
+			while (format_row_pieces(&pl->format, batch->row, batch->row_lengths, &piece, out->data)) {
+				out->partial = !piece.done;
+				if (piece.done) {
+					out->reserved = batch->reserved;
+					batch->reserved = 0;
+				}
+				g_async_queue_push(pl->buffers, out);
+				out = (struct write_buffer *)g_async_queue_pop(pl->free_buffers);
+				out->type = BATCH_ROWS;
+			}
+			batch->type = BATCH_ROWS;
+			g_async_queue_push(pl->row_done, batch);
+			trace_end("format", start, "large row");
+			continue;
+		}
+
+		if (batch->type != BATCH_ROWS) {
+			/* Close pending statement and pass end of table (or shutdown) to write stage */
+			if (out->data->len) {
+				format_finish(out->data);
+				g_async_queue_push(pl->buffers, out);
+				out = (struct write_buffer *)g_async_queue_pop(pl->free_buffers);
+			}
+			out->type = batch->type;
+			g_async_queue_push(pl->buffers, out);
+			out = NULL;
+
+			enum batch_type type = batch->type;
+			batch->type = BATCH_ROWS;
+			g_async_queue_push(pl->free_batches, batch);
+			if (type == BATCH_SHUTDOWN)
+				break;
+			continue;
+		}
+
+		/* Every statement closed over the size limit goes to the write stage right away */
+		batch_cursor_init(&cursor, batch);
+		while (format_rows(&pl->format, batch, &cursor, out->data)) {
+			g_async_queue_push(pl->buffers, out);
+			out = (struct write_buffer *)g_async_queue_pop(pl->free_buffers);
+			out->type = BATCH_ROWS;
+		}
+
+		g_string_set_size(batch->data, 0);
+		g_array_set_size(batch->lengths, 0);
+		batch->rows = 0;
+		g_async_queue_push(pl->free_batches, batch);
+		trace_end("format", start, NULL);
+	}
+
+	return NULL;
+}
+
+/* Session settings every data file starts with, returns bytes written */
+gsize write_file_header(struct output_file *file) {
+	GString* statement = g_string_sized_new(128);
+	gsize len;
 
 	g_string_printf(statement,"/*!40101 SET NAMES binary*/;\n");
 	g_string_append(statement,"/*!40101 SET FOREIGN_KEY_CHECKS=0*/;\n");
 	write_data(file, statement);
+	len = statement->len;
+	g_string_free(statement,TRUE);
+	return len;
+}
+
+/* Name of the part-th file of a rotated output: db.table.sql becomes db.table.00001.sql */
+gchar *filename_part(const char *filename, guint part) {
+	const gchar *ext = g_strrstr(filename, ".sql");
+	gchar *base = g_strndup(filename, ext - filename);
+	gchar *name = g_strdup_printf("%s.%05u%s", base, part, ext);
+	g_free(base);
+	return name;
+}
+
+/* Drains finished statements to the output file, signals fetch stage once a table is complete */
+void *write_stage(struct pipeline *pl) {
+	trace_thread("worker %u write", pl->stats->id);
+	for (;;) {
+		struct write_buffer *buffer = (struct write_buffer *)g_async_queue_pop(pl->buffers);
+		enum batch_type type = buffer->type;
+
+		/* Between statements is a safe place to roll over */
+		if (type == BATCH_ROWS && chunk_filesize && pl->file && !pl->continued && pl->written >= (guint64)chunk_filesize*1024*1024) {
+			if (output_close(pl->file)) {
+				g_critical("Could not write output file %s (%d)", pl->filename, errno);
+				pl->failed = TRUE;
+			}
+			gchar *filename = filename_part(pl->filename, ++pl->part);
+			pl->file = output_open(filename, output_codec);
+			if (!pl->file) {
+				/* Rest of the job is dropped, the job fails once fetch stage is done with it */
+				g_critical("Could not create output file %s (%d)", filename, errno);
+				pl->failed = TRUE;
+			} else
+				pl->written = write_file_header(pl->file);
+			g_free(filename);
+		}
+
+		if (type == BATCH_ROWS && pl->target) {
+			clone_write(pl, buffer);
+			pl->stats->bytes_written += buffer->data->len;
+		} else if (type == BATCH_ROWS && pl->file) {
+			/* Error sticks to the file, report it once */
+			if (write_data(pl->file, buffer->data) < 0 && !pl->failed) {
+				g_critical("Could not write output file %s (%d)", pl->filename, errno);
+				pl->failed = TRUE;
+			}
+			pl->written += buffer->data->len;
+			pl->stats->bytes_written += buffer->data->len;
+		}
+
+		pl->continued = buffer->partial;
+		g_string_set_size(buffer->data, 0);
+		buffer->type = BATCH_ROWS;
+		buffer->partial = FALSE;
+		buffer->reserved = 0;
+		g_async_queue_push(pl->free_buffers, buffer);
+
+		if (type == BATCH_END)
+			g_async_queue_push(pl->done, GINT_TO_POINTER(1));
+		else if (type == BATCH_SHUTDOWN)
+			break;
+	}
+	return NULL;
+}
+
+/* Do actual data chunk reading/writing magic - this is the fetch stage of the pipeline */
+guint64 dump_table_data(MYSQL *conn, struct pipeline *pl, char *database, char *table, char *partition, char *where)
+{
+	guint i;
+	guint num_fields = 0;
+	guint64 num_rows = 0;
+	MYSQL_RES *result = NULL;
+	char *query = NULL, *source;
+	guint64 start = trace_now(), stall;
 
 	/* Poor man's database code */
-	query = g_strdup_printf("SELECT * FROM `%s`.`%s` %s %s", database, table, where?"WHERE":"", where?where:"");
+	source = table_source(database, table, partition);
+	query = g_strdup_printf("SELECT * FROM %s %s %s", source, where?"WHERE":"", where?where:"");
+	g_free(source);
 	if (mysql_query(conn, query)) {
 		g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
+		pl->failed = TRUE;
 		g_free(query);
 		return num_rows;
 	}
 
 	result = mysql_use_result(conn);
+	trace_end("query", start, where);
+	start = trace_now();
 	num_fields = mysql_num_fields(result);
 	MYSQL_FIELD *fields = mysql_fetch_fields(result);
 
-	/* Buffer for escaping field values */
-	GString *escaped = g_string_sized_new(3000);
+	/* Nothing is in flight between tables, so other stages pick this up with the first batch */
+	pl->format.table = table;
+	pl->format.num_fields = num_fields;
+	pl->format.formatters = g_renew(field_formatter, pl->format.formatters, num_fields);
+	for (i = 0; i < num_fields; i++)
+		pl->format.formatters[i] = get_field_formatter(&fields[i]);
 
 	MYSQL_ROW row;
-
-	g_string_set_size(statement,0);
-
-	/* Poor man's data dump code */
-	while ((row = mysql_fetch_row(result))) {
+	struct row_batch *batch = (struct row_batch *)g_async_queue_pop(pl->free_batches);
+	/* Biggest row of this result set too large to copy, and what is taken off the memory budget for the row at hand */
+	guint64 large = 0, reserved = 0;
+
+	/* Row data is only valid until next fetch, so copy it out in statement sized batches */
+	for (;;) {
+		/* After one huge row the next one may be as big, wait for room in the budget before reading it */
+		memory_reserve(reserved = large);
+		if (!(row = mysql_fetch_row(result))) {
+			/* End of rows or a result set cut off, only the error tells them apart */
+			if (mysql_errno(conn)) {
+				g_critical("Error dumping table (%s.%s) data: %s ",database, table, mysql_error(conn));
+				pl->failed = TRUE;
+			}
+			break;
+		}
 		gulong *lengths = mysql_fetch_lengths(result);
+		guint64 row_length = 0;
 		num_rows++;
 
-		if (!statement->len)
-			g_string_printf(statement, "INSERT INTO `%s` VALUES\n (", table);
-		else
-			g_string_append(statement, ",\n (");
-
-		for (i = 0; i < num_fields; i++) {
-			/* Don't escape safe formats, saves some time */
-			if (!row[i]) {
-				g_string_append(statement, "NULL");
-			} else if (fields[i].flags & NUM_FLAG) {
-				g_string_append_printf(statement, "\"%s\"", row[i]);
-			} else {
-				/* We reuse buffers for string escaping, growing is expensive just at the beginning */
-				g_string_set_size(escaped, lengths[i]*2+1);
-				mysql_real_escape_string(conn, escaped->str, row[i], lengths[i]);
-				g_string_append(statement,"\"");
-				g_string_append(statement,escaped->str);
-				g_string_append(statement,"\"");
-
-			}
-			if (i < num_fields - 1) {
-				g_string_append(statement,",");
-			} else {
-				/* INSERT statement is closed once over limit */
-				if (statement->len > statement_size) {
-					g_string_append(statement,");\n");
-					write_data(file,statement);
-					g_string_set_size(statement,0);
-
-				} else {
-					g_string_append(statement, ")");
+		for (i = 0; i < num_fields; i++)
+			if (row[i])
+				row_length += lengths[i];
+
+		if (row_length > statement_size) {
+			guint64 needed = row_length, statement = 0;
+			if (pl->target) {
+				/* Can't be inserted in any form, better to fail before putting it together */
+				if (row_length > target_max_packet) {
+					g_critical("Error: DB: %s TABLE: %s Row of %llu bytes is larger than max_allowed_packet (%llu) of clone target",
+						database, table, (unsigned long long)row_length, (unsigned long long)target_max_packet);
+					pl->failed = TRUE;
+					memory_release(reserved);
+					continue;
 				}
+				/* Escaping at most doubles the row, the write stage holds the whole statement before running it */
+				statement = MIN(2 * row_length + statement_size, target_max_packet);
+				needed += statement;
+			}
+			if (needed > reserved) {
+				memory_release(reserved);
+				memory_reserve(reserved = large = needed);
+			}
+			/* Rows before it go first, then the row is formatted straight out of the client buffer */
+			if (batch->rows) {
+				pl->stats->rows += batch->rows;
+				pl->stats->bytes_fetched += batch->data->len;
+				g_async_queue_push(pl->batches, batch);
+				batch = (struct row_batch *)g_async_queue_pop(pl->free_batches);
 			}
+			batch->type = BATCH_LARGE_ROW;
+			batch->row = row;
+			batch->row_lengths = lengths;
+			/* Statement part of the reservation goes along with the row, the write stage gives it back */
+			batch->reserved = statement;
+			g_async_queue_push(pl->batches, batch);
+			stall = trace_now();
+			batch = (struct row_batch *)g_async_queue_pop(pl->row_done);
+			trace_end("stall", stall, "large row");
+			pl->stats->rows++;
+			pl->stats->bytes_fetched += row_length;
+			memory_release(reserved - statement);
+			continue;
+		}
+		memory_release(reserved);
+
+		for (i = 0; i < num_fields; i++)
+			batch_add_cell(batch, row[i], lengths[i]);
+		batch->rows++;
+
+		if (batch->data->len > statement_size) {
+			pl->stats->rows += batch->rows;
+			pl->stats->bytes_fetched += batch->data->len;
+			g_async_queue_push(pl->batches, batch);
+			/* Format stage not keeping up shows as stalls inside fetch */
+			stall = trace_now();
+			batch = (struct row_batch *)g_async_queue_pop(pl->free_batches);
+			trace_end("stall", stall, NULL);
 		}
 	}
-	write_data(file, statement);
-	g_string_printf(statement,";\n");
-	write_data(file, statement);
+	memory_release(reserved);
+	trace_end("fetch", start, NULL);
+
+	if (batch->rows) {
+		pl->stats->rows += batch->rows;
+		pl->stats->bytes_fetched += batch->data->len;
+		g_async_queue_push(pl->batches, batch);
+		batch = (struct row_batch *)g_async_queue_pop(pl->free_batches);
+	}
+	batch->type = BATCH_END;
+	g_async_queue_push(pl->batches, batch);
+
+	/* Wait for the tail of this table to hit the file before it gets closed */
+	start = trace_now();
+	g_async_queue_pop(pl->done);
+	trace_end("drain", start, NULL);
+
 	// cleanup:
 	g_free(query);
 
-	g_string_free(escaped,TRUE);
-	g_string_free(statement,TRUE);
-
 	if (result) {
 		mysql_free_result(result);
 	}
@@ -817,11 +3388,120 @@ guint64 dump_table_data(MYSQL *conn, FILE *file, char *database, char *table, ch
 	return num_rows;
 }
 
-int write_data(void *file, GString *data)
-{
-	if (!compress_output)
-		return write(fileno(file),data->str,data->len);
-	else
-		return gzwrite((gzFile)file,data->str,data->len);
+/* Session on the clone target, set up the way dump files start */
+MYSQL *connect_target(void) {
+	MYSQL *target = mysql_init(NULL);
+	mysql_options(target, MYSQL_READ_DEFAULT_GROUP, "mydumper");
+
+	if (!mysql_real_connect(target, target_host, target_user ? target_user : username, target_password ? target_password : password,
+			NULL, target_port, target_socket, 0)) {
+		g_critical("Error connecting to clone target: %s", mysql_error(target));
+		exit(EXIT_FAILURE);
+	}
+	if (mysql_query(target, "SET SESSION wait_timeout = 2147483"))
+		g_warning("Failed to increase wait_timeout on clone target: %s", mysql_error(target));
+
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+	if (mysql_query(target, "SELECT @@max_allowed_packet") || !(result = mysql_store_result(target))) {
+		g_critical("Error reading max_allowed_packet of clone target: %s", mysql_error(target));
+		exit(EXIT_FAILURE);
+	}
+	if ((row = mysql_fetch_row(result)) && row[0])
+		target_max_packet = g_ascii_strtoull(row[0], NULL, 10);
+	mysql_free_result(result);
+	mysql_query(target, "/*!40101 SET NAMES binary*/");
+	mysql_query(target, "/*!40014 SET FOREIGN_KEY_CHECKS=0, UNIQUE_CHECKS=0*/");
+	return target;
 }
 
+/* Create database.table on the clone target from SHOW CREATE TABLE on the source, FALSE if it can't be cloned */
+gboolean clone_schema(MYSQL *conn, char *database, char *table) {
+	MYSQL_RES *result;
+	MYSQL_ROW row;
+	gboolean created = FALSE;
+	gchar *query = g_strdup_printf("SHOW CREATE TABLE `%s`.`%s`", database, table);
+
+	if (mysql_query(conn, query) || !(result = mysql_store_result(conn))) {
+		g_critical("Error: DB: %s TABLE: %s Could not read table definition: %s", database, table, mysql_error(conn));
+		g_free(query);
+		return FALSE;
+	}
+	g_free(query);
+	if (!(row = mysql_fetch_row(result))) {
+		mysql_free_result(result);
+		return FALSE;
+	}
+
+	query = g_strdup_printf("CREATE DATABASE IF NOT EXISTS `%s`", database);
+	if (mysql_query(target_conn, query) || mysql_select_db(target_conn, database)) {
+		g_critical("Error: DB: %s Could not create database on clone target: %s", database, mysql_error(target_conn));
+		goto cleanup;
+	}
+	g_free(query);
+	query = g_strdup_printf("DROP TABLE IF EXISTS `%s`", table);
+	if (target_drop_tables && mysql_query(target_conn, query)) {
+		g_critical("Error: DB: %s TABLE: %s Could not drop table on clone target: %s", database, table, mysql_error(target_conn));
+		goto cleanup;
+	}
+	/* Definition comes without database name, the target has it selected */
+	if (mysql_query(target_conn, row[1])) {
+		g_critical("Error: DB: %s TABLE: %s Could not create table on clone target, skipping it: %s", database, table, mysql_error(target_conn));
+		goto cleanup;
+	}
+	created = TRUE;
+
+cleanup:
+	g_free(query);
+	mysql_free_result(result);
+	return created;
+}
+
+/*
+ * Run a buffer of the format stage on the clone target. Buffers hold a single INSERT each,
+ * only a huge row's statement spans several and is put together first
+ */
+void clone_write(struct pipeline *pl, struct write_buffer *buffer) {
+	GString *statement = buffer->data;
+	guint64 start;
+
+	if (buffer->partial || pl->continued) {
+		if (!pl->statement)
+			pl->statement = g_string_sized_new(buffer->data->len * 2);
+		g_string_append_len(pl->statement, buffer->data->str, buffer->data->len);
+		if (buffer->partial)
+			return;
+		statement = pl->statement;
+	}
+
+	/* No multi-statements on this connection, leave out the terminator */
+	gsize len = statement->len;
+	while (len && (statement->str[len-1] == '\n' || statement->str[len-1] == ';'))
+		len--;
+
+	start = trace_now();
+	if (len > target_max_packet) {
+		g_critical("Error: Statement of %llu bytes for %s is larger than max_allowed_packet (%llu) of clone target",
+			(unsigned long long)len, pl->filename, (unsigned long long)target_max_packet);
+		pl->failed = TRUE;
+	} else if (len && mysql_real_query(pl->target, statement->str, len)) {
+		g_critical("Error: Could not insert into clone target for %s: %s", pl->filename, mysql_error(pl->target));
+		pl->failed = TRUE;
+	}
+	trace_end("insert", start, NULL);
+
+	/* Huge statements are not kept around */
+	if (statement == pl->statement) {
+		g_string_free(pl->statement, TRUE);
+		pl->statement = NULL;
+	}
+	memory_release(buffer->reserved);
+}
+
+int write_data(struct output_file *file, GString *data)
+{
+	guint64 start = trace_now();
+	int ret = output_write(file, data->str, data->len);
+	trace_end("write", start, NULL);
+	return ret;
+}
@@ -0,0 +1,455 @@
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <mysql.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "compress.h"
+
+struct configuration {
+	GAsyncQueue *queue;
+	GAsyncQueue *ready;
+	GMutex *mutex;
+	int errors;
+};
+
+/* Database options */
+char *hostname=NULL;
+char *username=NULL;
+char *password=NULL;
+char *socket_path=NULL;
+char *db=NULL;
+guint port=3306;
+
+/* Program options */
+guint num_threads = 4;
+gchar *directory = NULL;
+guint commit_count = 1000;
+int enable_binlog = 0;
+int stream_input = 0;
+
+static GOptionEntry entries[] =
+{
+	{ "host", 'h', 0, G_OPTION_ARG_STRING, &hostname, "The host to connect to", NULL },
+	{ "user", 'u', 0, G_OPTION_ARG_STRING, &username, "Username with privileges to run the restore", NULL },
+	{ "password", 'p', 0, G_OPTION_ARG_STRING, &password, "User password", NULL },
+	{ "port", 'P', 0, G_OPTION_ARG_INT, &port, "TCP/IP port to connect to", NULL },
+	{ "socket", 'S', 0, G_OPTION_ARG_STRING, &socket_path, "UNIX domain socket file to use for connection", NULL },
+	{ "database", 'B', 0, G_OPTION_ARG_STRING, &db, "An alternative database to restore into", NULL },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &num_threads, "Number of parallel threads", NULL },
+	{ "directory", 'd', 0, G_OPTION_ARG_FILENAME, &directory, "Directory of the dump to import", NULL },
+	{ "queries-per-transaction", 'q', 0, G_OPTION_ARG_INT, &commit_count, "Number of queries per transaction, default 1000", NULL },
+	{ "enable-binlog", 'e', 0, G_OPTION_ARG_NONE, &enable_binlog, "Enable binary logging of the restore data", NULL },
+	{ "stream", 0, 0, G_OPTION_ARG_NONE, &stream_input, "Restore a mydumper --stream archive read from standard input", NULL },
+	{ NULL, 0, 0, G_OPTION_ARG_NONE,   NULL, NULL, NULL }
+};
+
+enum job_type { JOB_SHUTDOWN, JOB_RESTORE };
+
+struct job {
+	enum job_type type;
+	char *database;
+	char *table;
+	char *filename;
+	/* Already open input of a --stream file, NULL to read filename */
+	struct input_file *input;
+	struct configuration *conf;
+};
+
+/* Pieces of a --stream file buffered once a worker reads it, files nobody reads yet are never throttled */
+#define STREAM_DEPTH 8
+
+/* --stream file being demultiplexed, pieces go to chunks and the reader reports back on returned */
+struct stream_file {
+	GAsyncQueue *chunks;
+	GAsyncQueue *returned;
+	guint outstanding;
+	gboolean claimed;
+	gboolean abandoned;
+};
+
+void *process_queue(struct configuration *conf);
+void restore_databases(struct configuration *conf);
+void restore_stream(struct configuration *conf);
+gboolean is_data_file(const char *filename);
+gboolean add_file(struct configuration *conf, const char *filename, struct input_file *input);
+guint64 restore_data(MYSQL *conn, char *database, char *table, char *filename, struct input_file *infile);
+int restore_statement(MYSQL *conn, GString *statement);
+void stream_file_event(struct stream_file *f, gpointer event);
+void stream_file_feed(struct stream_file *f, GString *chunk);
+void stream_file_free(struct stream_file *f);
+
+int main(int argc, char *argv[])
+{
+	struct configuration conf = { NULL, NULL, NULL, 0 };
+
+	GError *error = NULL;
+	GOptionContext *context;
+
+	g_thread_init(NULL);
+
+	context = g_option_context_new("multi-threaded MySQL loader");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_print ("option parsing failed: %s, try --help\n", error->message);
+		exit (EXIT_FAILURE);
+	}
+	g_option_context_free(context);
+
+	if (stream_input) {
+		if (directory)
+			g_warning("--directory is ignored with --stream");
+	} else if (!directory) {
+		g_critical("a directory needs to be specified, see --help\n");
+		exit(EXIT_FAILURE);
+	} else if (!g_file_test(directory, G_FILE_TEST_IS_DIR)) {
+		g_critical("the specified directory is not a directory: %s", directory);
+		exit(EXIT_FAILURE);
+	}
+
+	conf.queue = g_async_queue_new();
+	conf.ready = g_async_queue_new();
+	conf.mutex = g_mutex_new();
+
+	guint n;
+	GThread **threads = g_new(GThread*,num_threads);
+	for (n=0; n<num_threads; n++) {
+		threads[n] = g_thread_create((GThreadFunc)process_queue,&conf,TRUE,NULL);
+		g_async_queue_pop(conf.ready);
+	}
+	g_async_queue_unref(conf.ready);
+
+	if (stream_input)
+		restore_stream(&conf);
+	else
+		restore_databases(&conf);
+
+	for (n=0; n<num_threads; n++) {
+		struct job *j = g_new0(struct job,1);
+		j->type = JOB_SHUTDOWN;
+		g_async_queue_push(conf.queue,j);
+	}
+
+	for (n=0; n<num_threads; n++) {
+		g_thread_join(threads[n]);
+	}
+	g_async_queue_unref(conf.queue);
+	g_mutex_free(conf.mutex);
+
+	mysql_library_end();
+	g_free(threads);
+	g_free(directory);
+
+	return conf.errors ? EXIT_FAILURE : 0;
+}
+
+/*
+ * Walk the export directory and hand every data file to the workers,
+ * chunks of the same table end up spread across all connections
+ */
+void restore_databases(struct configuration *conf) {
+	GError *error = NULL;
+	GDir *dir = g_dir_open(directory, 0, &error);
+
+	if (error) {
+		g_critical("cannot open directory %s, %s\n", directory, error->message);
+		g_error_free(error);
+		exit(EXIT_FAILURE);
+	}
+
+	const gchar *filename = NULL;
+
+	while((filename = g_dir_read_name(dir))) {
+		/* .metadata and friends are not data */
+		if (filename[0] == '.')
+			continue;
+		if (is_data_file(filename))
+			add_file(conf, filename, NULL);
+	}
+
+	g_dir_close(dir);
+}
+
+gboolean is_data_file(const char *filename) {
+	return g_str_has_suffix(filename, ".sql") || g_str_has_suffix(filename, ".sql.gz")
+		|| g_str_has_suffix(filename, ".sql.zst") || g_str_has_suffix(filename, ".sql.lz4");
+}
+
+/*
+ * Data files are named db.table.sql or db.table.NNNNN.sql, with optional .gz, .zst or .lz4.
+ * input is the already open input of a --stream file, NULL to read the file from directory
+ */
+gboolean add_file(struct configuration *conf, const char *filename, struct input_file *input) {
+	gchar **split_file = g_strsplit(filename, ".", 3);
+
+	if (g_strv_length(split_file) < 3) {
+		g_warning("Skipping file with unexpected name: %s", filename);
+		g_strfreev(split_file);
+		return FALSE;
+	}
+
+	struct job *j = g_new0(struct job, 1);
+	j->type = JOB_RESTORE;
+	j->database = g_strdup(db ? db : split_file[0]);
+	j->table = g_strdup(split_file[1]);
+	j->filename = input ? g_strdup(filename) : g_build_filename(directory, filename, NULL);
+	j->input = input;
+	j->conf = conf;
+	g_async_queue_push(conf->queue, j);
+
+	g_strfreev(split_file);
+	return TRUE;
+}
+
+/*
+ * Demultiplex a mydumper --stream archive from standard input. Every data file becomes a restore job
+ * as soon as it starts, its pieces are handed to whichever worker picks the job up
+ */
+void restore_stream(struct configuration *conf) {
+	GHashTable *files = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)stream_file_free);
+	GString *payload = g_string_sized_new(COMPRESS_BLOCK_SIZE);
+	enum stream_frame type;
+	guint32 id;
+	int ret;
+
+	while ((ret = stream_read_frame(STDIN_FILENO, &type, &id, payload)) > 0) {
+		struct stream_file *f = g_hash_table_lookup(files, GUINT_TO_POINTER(id));
+
+		switch (type) {
+			case STREAM_OPEN: {
+				/* .metadata and friends are not data, their frames are skipped */
+				if (payload->str[0] == '.' || !is_data_file(payload->str))
+					break;
+				f = g_new0(struct stream_file, 1);
+				f->chunks = g_async_queue_new();
+				f->returned = g_async_queue_new();
+				struct input_file *input = input_open_chunks(payload->str, f->chunks, f->returned);
+				if (!input || !add_file(conf, payload->str, input)) {
+					if (input)
+						input_close(input);
+					stream_file_free(f);
+					break;
+				}
+				g_hash_table_insert(files, GUINT_TO_POINTER(id), f);
+				break;
+			}
+			case STREAM_DATA:
+				if (f && payload->len) {
+					GString *chunk = g_string_sized_new(payload->len);
+					g_string_append_len(chunk, payload->str, payload->len);
+					stream_file_feed(f, chunk);
+				}
+				break;
+			case STREAM_CLOSE:
+				if (f) {
+					stream_file_feed(f, g_string_new(""));
+					g_hash_table_remove(files, GUINT_TO_POINTER(id));
+				}
+				break;
+		}
+	}
+
+	if (ret < 0) {
+		g_critical("Corrupt or truncated stream on standard input");
+		conf->errors++;
+	}
+	if (g_hash_table_size(files)) {
+		/* Whatever arrived is restored, the rest of those files is lost */
+		GHashTableIter iter;
+		struct stream_file *f;
+		g_critical("Stream ended in the middle of %u files", g_hash_table_size(files));
+		conf->errors++;
+		g_hash_table_iter_init(&iter, files);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&f))
+			stream_file_feed(f, g_string_new(""));
+	}
+	g_hash_table_destroy(files);
+	g_string_free(payload, TRUE);
+}
+
+void stream_file_event(struct stream_file *f, gpointer event) {
+	switch (GPOINTER_TO_INT(event)) {
+		case STREAM_CLAIMED:
+			f->claimed = TRUE;
+			break;
+		case STREAM_CONSUMED:
+			f->outstanding--;
+			break;
+		case STREAM_CLOSED:
+			/* Reader gave up (restore error), nobody is going to take the rest */
+			f->abandoned = TRUE;
+			break;
+	}
+}
+
+/* Hand a piece to the reader, waits for it to catch up once it is reading and STREAM_DEPTH pieces ahead */
+void stream_file_feed(struct stream_file *f, GString *chunk) {
+	gpointer event;
+
+	while ((event = g_async_queue_try_pop(f->returned)))
+		stream_file_event(f, event);
+	while (f->claimed && !f->abandoned && f->outstanding >= STREAM_DEPTH)
+		stream_file_event(f, g_async_queue_pop(f->returned));
+
+	if (f->abandoned) {
+		GString *left;
+		while ((left = g_async_queue_try_pop(f->chunks)))
+			g_string_free(left, TRUE);
+		g_string_free(chunk, TRUE);
+		return;
+	}
+	f->outstanding++;
+	g_async_queue_push(f->chunks, chunk);
+}
+
+void stream_file_free(struct stream_file *f) {
+	g_async_queue_unref(f->chunks);
+	g_async_queue_unref(f->returned);
+	g_free(f);
+}
+
+void *process_queue(struct configuration *conf) {
+	mysql_thread_init();
+	MYSQL *thrconn = mysql_init(NULL);
+	mysql_options(thrconn,MYSQL_READ_DEFAULT_GROUP,"myloader");
+
+	if (!mysql_real_connect(thrconn, hostname, username, password, NULL, port, socket_path, 0)) {
+		g_critical("Failed to connect to database: %s", mysql_error(thrconn));
+		exit(EXIT_FAILURE);
+	}
+	if (mysql_query(thrconn, "SET SESSION wait_timeout = 2147483")) {
+		g_warning("Failed to increase wait_timeout: %s", mysql_error(thrconn));
+	}
+	if (!enable_binlog && mysql_query(thrconn, "SET SQL_LOG_BIN=0")) {
+		g_warning("Failed to disable binary logging: %s", mysql_error(thrconn));
+	}
+	/* Data comes in primary key order from a consistent snapshot, no need to verify it again */
+	mysql_query(thrconn, "/*!40101 SET NAMES binary*/");
+	mysql_query(thrconn, "/*!40014 SET UNIQUE_CHECKS=0*/");
+	mysql_query(thrconn, "/*!40014 SET FOREIGN_KEY_CHECKS=0*/");
+
+	g_async_queue_push(conf->ready,GINT_TO_POINTER(1));
+
+	struct job* job;
+	for(;;) {
+		job=(struct job *)g_async_queue_pop(conf->queue);
+		switch (job->type) {
+			case JOB_RESTORE:
+				g_message("Restoring %s.%s from %s", job->database, job->table, job->filename);
+				if (restore_data(thrconn, job->database, job->table, job->filename, job->input) == G_MAXUINT64) {
+					g_mutex_lock(conf->mutex);
+					conf->errors++;
+					g_mutex_unlock(conf->mutex);
+				}
+				break;
+			case JOB_SHUTDOWN:
+				if (thrconn)
+					mysql_close(thrconn);
+				g_free(job);
+				mysql_thread_end();
+				return NULL;
+				break;
+		}
+		if(job->database) g_free(job->database);
+		if(job->table) g_free(job->table);
+		if(job->filename) g_free(job->filename);
+		g_free(job);
+	}
+	return NULL;
+}
+
+/*
+ * Replay one chunk file, committing every commit_count statements and at the end of the chunk.
+ * Compressed files are decompressed inline, codec is picked by file extension.
+ * infile is the already open input of a --stream file, NULL to open filename.
+ * Returns number of statements executed, G_MAXUINT64 on error
+ */
+guint64 restore_data(MYSQL *conn, char *database, char *table, char *filename, struct input_file *infile) {
+	guint64 query_counter = 0;
+	GString *data = g_string_sized_new(512);
+
+	if (mysql_select_db(conn, database)) {
+		g_critical("Error switching to database %s whilst restoring table %s: %s", database, table, mysql_error(conn));
+		g_string_free(data, TRUE);
+		if (infile)
+			input_close(infile);
+		return G_MAXUINT64;
+	}
+
+	if (!infile)
+		infile = input_open(filename);
+
+	if (!infile) {
+		g_critical("cannot open file %s (%d)", filename, errno);
+		g_string_free(data, TRUE);
+		return G_MAXUINT64;
+	}
+
+	mysql_query(conn, "START TRANSACTION");
+
+	while (input_readline(infile, data)) {
+		/* Statements always end with ";\n", data never contains a raw newline */
+		if (data->len < 2 || data->str[data->len-1] != '\n' || data->str[data->len-2] != ';')
+			continue;
+
+		if (restore_statement(conn, data)) {
+			g_critical("Error restoring %s.%s from file %s: %s", database, table, filename, mysql_error(conn));
+			mysql_query(conn, "ROLLBACK");
+			input_close(infile);
+			g_string_free(data, TRUE);
+			return G_MAXUINT64;
+		}
+		query_counter++;
+		if (commit_count && query_counter % commit_count == 0) {
+			mysql_query(conn, "COMMIT");
+			mysql_query(conn, "START TRANSACTION");
+		}
+		g_string_set_size(data, 0);
+	}
+
+	/* Whatever was read of a broken file is not restored */
+	if (input_error(infile)) {
+		g_critical("Error reading %s.%s from file %s, rolling back", database, table, filename);
+		mysql_query(conn, "ROLLBACK");
+		input_close(infile);
+		g_string_free(data, TRUE);
+		return G_MAXUINT64;
+	}
+
+	/* Trailing statement without newline */
+	if (data->len && restore_statement(conn, data)) {
+		g_critical("Error restoring %s.%s from file %s: %s", database, table, filename, mysql_error(conn));
+		mysql_query(conn, "ROLLBACK");
+		input_close(infile);
+		g_string_free(data, TRUE);
+		return G_MAXUINT64;
+	}
+
+	if (mysql_query(conn, "COMMIT")) {
+		g_critical("Error committing data for %s.%s: %s", database, table, mysql_error(conn));
+		query_counter = G_MAXUINT64;
+	}
+
+	input_close(infile);
+	g_string_free(data, TRUE);
+
+	return query_counter;
+}
+
+/* Run a single statement, blank lines and a lone ';' are not worth a roundtrip */
+int restore_statement(MYSQL *conn, GString *statement) {
+	gsize len = statement->len;
+
+	while (len && (statement->str[len-1] == '\n' || statement->str[len-1] == ';' || statement->str[len-1] == ' '))
+		len--;
+	if (!len)
+		return 0;
+
+	return mysql_real_query(conn, statement->str, len);
+}
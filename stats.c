@@ -0,0 +1,197 @@
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "stats.h"
+#include "memory.h"
+
+/* Registered workers, the mutex only guards the array, never the counters */
+static GMutex *workers_mutex = NULL;
+static GPtrArray *workers = NULL;
+
+/* Planned totals, grow as jobs are handed out */
+static guint64 planned_rows = 0;
+static guint64 planned_bytes = 0;
+
+static gchar *stats_filename = NULL;
+static guint stats_interval = 10;
+static GAsyncQueue *stats_queue = NULL;
+static GThread *stats_thread = NULL;
+static GMutex *stop_mutex = NULL;
+static GCond *stop_cond = NULL;
+static gboolean stopping = FALSE;
+
+static void stats_init(void) {
+	if (!workers_mutex) {
+		workers_mutex = g_mutex_new();
+		workers = g_ptr_array_new();
+	}
+}
+
+/* Counters for the calling worker, lives until the end of the process */
+struct worker_stats *stats_register(void) {
+	struct worker_stats *stats = g_new0(struct worker_stats, 1);
+
+	g_mutex_lock(workers_mutex);
+	stats->id = workers->len;
+	g_ptr_array_add(workers, stats);
+	g_mutex_unlock(workers_mutex);
+	return stats;
+}
+
+void stats_set_table(struct worker_stats *stats, const char *database, const char *table) {
+	g_snprintf(stats->table, STATS_TABLE_LEN, "%s.%s", database, table);
+}
+
+/* Add estimated rows and bytes of jobs handed to workers, base of the ETA. Only called by the discovering thread */
+void stats_plan(guint64 rows, guint64 bytes) {
+	planned_rows += rows;
+	planned_bytes += bytes;
+}
+
+/* Label values are quoted, backslash, quote and newline have to be escaped */
+static void append_label(GString *out, const char *value) {
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			g_string_append_c(out, '\\');
+		if (*value == '\n')
+			g_string_append(out, "\\n");
+		else
+			g_string_append_c(out, *value);
+	}
+}
+
+static void append_header(GString *out, const char *name, const char *type, const char *help) {
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void append_counter(GString *out, const char *name, const char *help, gsize offset) {
+	guint i;
+
+	append_header(out, name, "counter", help);
+	for (i = 0; i < workers->len; i++) {
+		struct worker_stats *stats = g_ptr_array_index(workers, i);
+		g_string_append_printf(out, "%s{worker=\"%u\"} %llu\n", name, stats->id,
+			(unsigned long long)*(volatile guint64 *)((char *)stats + offset));
+	}
+}
+
+/* Prometheus text format, written aside and renamed so scrapers never see half a file */
+static void stats_write(GTimeVal *start, guint64 *last_rows, GTimeVal *last) {
+	GString *out = g_string_sized_new(4096);
+	guint64 rows = 0, bytes = 0;
+	GTimeVal now;
+	guint i;
+
+	g_get_current_time(&now);
+	g_mutex_lock(workers_mutex);
+
+	append_counter(out, "mydumper_rows_total", "Rows fetched from the server", G_STRUCT_OFFSET(struct worker_stats, rows));
+	append_counter(out, "mydumper_fetched_bytes_total", "Bytes of row data fetched from the server", G_STRUCT_OFFSET(struct worker_stats, bytes_fetched));
+	append_counter(out, "mydumper_written_bytes_total", "Bytes of SQL handed to the output files, before compression", G_STRUCT_OFFSET(struct worker_stats, bytes_written));
+	append_counter(out, "mydumper_chunks_done_total", "Chunks (output files) finished", G_STRUCT_OFFSET(struct worker_stats, chunks_done));
+
+	append_header(out, "mydumper_worker_table", "gauge", "Table each worker is dumping");
+	for (i = 0; i < workers->len; i++) {
+		struct worker_stats *stats = g_ptr_array_index(workers, i);
+		char table[STATS_TABLE_LEN];
+		memcpy(table, stats->table, STATS_TABLE_LEN);
+		table[STATS_TABLE_LEN-1] = '\0';
+		rows += stats->rows;
+		bytes += stats->bytes_fetched;
+		if (!table[0])
+			continue;
+		g_string_append_printf(out, "mydumper_worker_table{worker=\"%u\",table=\"", stats->id);
+		append_label(out, table);
+		g_string_append(out, "\"} 1\n");
+	}
+	g_mutex_unlock(workers_mutex);
+
+	append_header(out, "mydumper_queue_depth", "gauge", "Jobs waiting for a worker");
+	g_string_append_printf(out, "mydumper_queue_depth %d\n", stats_queue ? g_async_queue_length(stats_queue) : 0);
+	append_header(out, "mydumper_planned_rows", "gauge", "Estimated rows of all planned chunks");
+	g_string_append_printf(out, "mydumper_planned_rows %llu\n", (unsigned long long)planned_rows);
+	append_header(out, "mydumper_planned_bytes", "gauge", "Estimated data length of all planned chunks");
+	g_string_append_printf(out, "mydumper_planned_bytes %llu\n", (unsigned long long)planned_bytes);
+	append_header(out, "mydumper_memory_reserved_bytes", "gauge", "Memory reserved from --memory-limit by row buffers");
+	g_string_append_printf(out, "mydumper_memory_reserved_bytes %llu\n", (unsigned long long)memory_reserved());
+
+	/* Rate over the last interval shows collapses, the ETA uses the whole run to stay stable */
+	gdouble interval = (now.tv_sec - last->tv_sec) + (now.tv_usec - last->tv_usec) / 1e6;
+	gdouble elapsed = (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+	append_header(out, "mydumper_rows_per_second", "gauge", "Rows fetched per second since the previous update");
+	g_string_append_printf(out, "mydumper_rows_per_second %.1f\n", interval > 0 ? (rows - *last_rows) / interval : 0.0);
+
+	/* Without row estimates (resumed dumps) progress is judged by data length */
+	gdouble done = planned_rows ? (gdouble)rows : (gdouble)bytes;
+	gdouble total = planned_rows ? (gdouble)planned_rows : (gdouble)planned_bytes;
+	if (done > 0 && elapsed > 0 && total > 0) {
+		append_header(out, "mydumper_eta_seconds", "gauge", "Estimated time left, based on row estimates");
+		g_string_append_printf(out, "mydumper_eta_seconds %.0f\n", done < total ? (total - done) * elapsed / done : 0.0);
+	}
+
+	*last_rows = rows;
+	*last = now;
+
+	gchar *tmp = g_strdup_printf("%s.tmp", stats_filename);
+	if (!g_file_set_contents(tmp, out->str, out->len, NULL) || g_rename(tmp, stats_filename))
+		g_warning("Couldn't write stats file %s (%d)", stats_filename, errno);
+	g_free(tmp);
+	g_string_free(out, TRUE);
+}
+
+static void *stats_loop(void *data) {
+	(void) data;
+	GTimeVal start, last, wakeup;
+	guint64 last_rows = 0;
+
+	g_get_current_time(&start);
+	last = start;
+
+	g_mutex_lock(stop_mutex);
+	while (!stopping) {
+		g_get_current_time(&wakeup);
+		g_time_val_add(&wakeup, (glong)stats_interval * G_USEC_PER_SEC);
+		g_cond_timed_wait(stop_cond, stop_mutex, &wakeup);
+		g_mutex_unlock(stop_mutex);
+		stats_write(&start, &last_rows, &last);
+		g_mutex_lock(stop_mutex);
+	}
+	g_mutex_unlock(stop_mutex);
+	return NULL;
+}
+
+/* Publish counters to filename every interval seconds, queue is the job queue whose depth is reported */
+void stats_start(const char *filename, guint interval, GAsyncQueue *queue) {
+	stats_init();
+	if (!filename)
+		return;
+
+	stats_filename = g_strdup(filename);
+	stats_interval = interval ? interval : 1;
+	stats_queue = queue;
+	stop_mutex = g_mutex_new();
+	stop_cond = g_cond_new();
+	stats_thread = g_thread_create((GThreadFunc)stats_loop, NULL, TRUE, NULL);
+}
+
+/* Final update with the complete counters */
+void stats_stop(void) {
+	if (!stats_thread)
+		return;
+
+	g_mutex_lock(stop_mutex);
+	stopping = TRUE;
+	g_cond_signal(stop_cond);
+	g_mutex_unlock(stop_mutex);
+	g_thread_join(stats_thread);
+	stats_thread = NULL;
+
+	g_cond_free(stop_cond);
+	g_mutex_free(stop_mutex);
+	g_free(stats_filename);
+}
@@ -0,0 +1,28 @@
+#ifndef _stats_h
+#define _stats_h
+
+#include <glib.h>
+
+#define STATS_TABLE_LEN 256
+
+/*
+ * Progress of one worker. Every counter has a single writer (rows, fetched bytes and chunks are
+ * bumped by the worker itself, written bytes by its write stage), the stats thread only reads them
+ */
+struct worker_stats {
+	guint id;
+	volatile guint64 rows;
+	volatile guint64 bytes_fetched;
+	volatile guint64 bytes_written;
+	volatile guint64 chunks_done;
+	/* db.table currently being dumped, may be read torn while it changes */
+	char table[STATS_TABLE_LEN];
+};
+
+struct worker_stats *stats_register(void);
+void stats_set_table(struct worker_stats *stats, const char *database, const char *table);
+void stats_plan(guint64 rows, guint64 bytes);
+void stats_start(const char *filename, guint interval, GAsyncQueue *queue);
+void stats_stop(void);
+
+#endif
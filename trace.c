@@ -0,0 +1,160 @@
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <glib.h>
+#include "trace.h"
+
+struct trace_event {
+	/* Static phase name, detail is owned by the event */
+	const char *name;
+	char *detail;
+	guint64 start;
+	guint64 duration;
+};
+
+struct trace_buffer {
+	guint tid;
+	char *name;
+	GArray *events;
+};
+
+static gchar *trace_filename = NULL;
+static GPrivate *current_buffer = NULL;
+static GMutex *buffers_mutex = NULL;
+static GPtrArray *buffers = NULL;
+static guint64 epoch = 0;
+
+static guint64 monotonic_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Enable tracing, has to be called before any thread is traced */
+void trace_init(const char *filename) {
+	if (!filename)
+		return;
+
+	trace_filename = g_strdup(filename);
+	current_buffer = g_private_new(NULL);
+	buffers_mutex = g_mutex_new();
+	buffers = g_ptr_array_new();
+	epoch = monotonic_usec();
+}
+
+/* Give the calling thread its own track, named after format */
+void trace_thread(const char *format, ...) {
+	va_list args;
+
+	if (!trace_filename)
+		return;
+
+	struct trace_buffer *buffer = g_new0(struct trace_buffer, 1);
+	va_start(args, format);
+	buffer->name = g_strdup_vprintf(format, args);
+	va_end(args);
+	buffer->events = g_array_new(FALSE, FALSE, sizeof(struct trace_event));
+
+	g_mutex_lock(buffers_mutex);
+	buffer->tid = buffers->len + 1;
+	g_ptr_array_add(buffers, buffer);
+	g_mutex_unlock(buffers_mutex);
+	g_private_set(current_buffer, buffer);
+}
+
+/* Start of a phase, hand it back to trace_end() */
+guint64 trace_now(void) {
+	return trace_filename ? monotonic_usec() : 0;
+}
+
+/* Record a phase that began at start, detail (table, file) is copied */
+void trace_end(const char *name, guint64 start, const char *detail) {
+	if (!trace_filename)
+		return;
+
+	struct trace_buffer *buffer = g_private_get(current_buffer);
+	if (!buffer)
+		return;
+
+	struct trace_event event;
+	event.name = name;
+	event.detail = detail ? g_strdup(detail) : NULL;
+	event.start = start - epoch;
+	event.duration = monotonic_usec() - start;
+	g_array_append_val(buffer->events, event);
+}
+
+static void append_escaped(GString *out, const char *s) {
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			g_string_append_c(out, '\\');
+		if ((unsigned char)*s < 0x20)
+			g_string_append_printf(out, "\\u%04x", (unsigned char)*s);
+		else
+			g_string_append_c(out, *s);
+	}
+}
+
+/* Write all tracks, called once every traced thread is done */
+void trace_write(void) {
+	guint i, j;
+
+	if (!trace_filename)
+		return;
+
+	FILE *file = fopen(trace_filename, "w");
+	if (!file) {
+		g_critical("Couldn't write trace file %s (%d)", trace_filename, errno);
+		return;
+	}
+
+	GString *out = g_string_sized_new(65536);
+	gboolean first = TRUE;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+	for (i = 0; i < buffers->len; i++) {
+		struct trace_buffer *buffer = g_ptr_array_index(buffers, i);
+
+		g_string_printf(out, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"", first ? "" : ",\n", buffer->tid);
+		append_escaped(out, buffer->name);
+		g_string_append(out, "\"}}");
+		first = FALSE;
+
+		for (j = 0; j < buffer->events->len; j++) {
+			struct trace_event *event = &g_array_index(buffer->events, struct trace_event, j);
+			g_string_append_printf(out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu,\"name\":\"%s\"",
+				buffer->tid, (unsigned long long)event->start, (unsigned long long)event->duration, event->name);
+			if (event->detail) {
+				g_string_append(out, ",\"args\":{\"detail\":\"");
+				append_escaped(out, event->detail);
+				g_string_append(out, "\"}");
+				g_free(event->detail);
+			}
+			g_string_append_c(out, '}');
+
+			/* Tracks of long dumps get big, keep the buffer bounded */
+			if (out->len > 60000) {
+				fwrite(out->str, 1, out->len, file);
+				g_string_set_size(out, 0);
+			}
+		}
+		fwrite(out->str, 1, out->len, file);
+		g_string_set_size(out, 0);
+
+		g_array_free(buffer->events, TRUE);
+		g_free(buffer->name);
+		g_free(buffer);
+	}
+	fputs("\n]}\n", file);
+	if (fclose(file))
+		g_critical("Couldn't write trace file %s (%d)", trace_filename, errno);
+
+	g_string_free(out, TRUE);
+	g_ptr_array_free(buffers, TRUE);
+	g_mutex_free(buffers_mutex);
+	g_free(trace_filename);
+	trace_filename = NULL;
+}
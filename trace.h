@@ -0,0 +1,17 @@
+#ifndef _trace_h
+#define _trace_h
+
+#include <glib.h>
+
+/*
+ * Phase timings for --trace-file. Threads record complete events into their own buffer,
+ * trace_write() dumps everything in Chrome trace-event JSON with one track per thread.
+ * With tracing off trace_now() returns 0 and trace_end() does nothing.
+ */
+void trace_init(const char *filename);
+void trace_thread(const char *format, ...) G_GNUC_PRINTF(1, 2);
+guint64 trace_now(void);
+void trace_end(const char *name, guint64 start, const char *detail);
+void trace_write(void);
+
+#endif